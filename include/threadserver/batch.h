@@ -0,0 +1,43 @@
+#ifndef THREADSERVER_BATCH_H
+#define THREADSERVER_BATCH_H
+
+#include <stddef.h>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace ThreadServer {
+
+// parts are claimed one by one by whoever runs the batch, the caller among
+// them, so a batch completes even when all helper threads are busy
+class ParallelBatch_t : public boost::noncopyable {
+public:
+    ParallelBatch_t(const size_t count);
+
+    virtual ~ParallelBatch_t();
+
+    // runs unclaimed parts until there are none left
+    void run();
+
+    // until all parts are done
+    void wait();
+
+    // how many helper threads the batch can use besides the caller
+    size_t helpers(const size_t threads) const;
+
+protected:
+    // called once for every index, possibly from several threads at once;
+    // must not throw
+    virtual void runPart(size_t index) = 0;
+
+    const size_t count;
+
+private:
+    size_t next;
+    size_t done;
+    boost::mutex mutex;
+    boost::condition_variable finished;
+};
+
+} // namespace ThreadServer
+
+#endif // THREADSERVER_BATCH_H
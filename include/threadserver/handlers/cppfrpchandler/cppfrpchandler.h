@@ -3,6 +3,7 @@
 #define THREADSERVER_HANDLER_CPP_FRPC_H
 
 #include <set>
+#include <vector>
 #include <frpc.h>
 #include <frpcfault.h>
 #include <frpcmethod.h>
@@ -150,6 +151,9 @@ public:
 private:
     typedef Module_t* (*ModuleCreateFunction_t)(CppFrpcHandler_t*);
 
+    class Multicall_t;
+    class MulticallBatch_t;
+
     class DlHandleGuard_t {
     public:
         DlHandleGuard_t(void *handle = 0);
@@ -166,6 +170,13 @@ private:
 
     std::string loadHelp(const std::string &methodName) const;
 
+    // FRPC server and module state of the calling thread
+    void threadCreate();
+
+    void threadDestroy();
+
+    void runMulticallWorker();
+
     time_t readTimeout;
     time_t writeTimeout;
     bool keepAlive;
@@ -178,6 +189,8 @@ private:
     boost::thread_specific_ptr<FRPC::Server_t> frpc;
     boost::thread_specific_ptr<SocketWork_t> work;
     std::string helpDirectory;
+    std::vector<boost::thread*> multicallWorkers;
+    threading::queue<boost::shared_ptr<MulticallBatch_t> > multicallQueue;
 };
 
 } // namespace ThreadServer
@@ -2,6 +2,7 @@
 #ifndef THREADSERVER_HANDLER_CPP_HTTP_H
 #define THREADSERVER_HANDLER_CPP_HTTP_H
 
+#include <deque>
 #include <set>
 #include <dbglog.h>
 #include <threadserver/error.h>
@@ -15,9 +16,13 @@
 #include <sstream>
 #include <stdexcept>
 #include <cxxabi.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <jsoncpp/reader.h>
 
 #include "json.h"
+#include "jsonbind.h"
+#include "jsonparser.h"
 
 namespace {
 
@@ -123,13 +128,114 @@ public:
         int _code;
     };
 
+    class ResponseWriter_t;
+
+    class MimeParameters_t;
+
+    // message headers kept as offsets into one buffer, common names are
+    // interned so their lookup is a table access; names are case-insensitive
+    class Headers_t {
+    public:
+        enum Id_t {
+            ACCEPT,
+            ACCEPT_ENCODING,
+            ACCEPT_LANGUAGE,
+            AUTHORIZATION,
+            CONNECTION,
+            CONTENT_LENGTH,
+            CONTENT_TYPE,
+            COOKIE,
+            EXPECT,
+            HOST,
+            IF_MODIFIED_SINCE,
+            IF_NONE_MATCH,
+            RANGE,
+            REFERER,
+            TRANSFER_ENCODING,
+            USER_AGENT,
+            X_FORWARDED_FOR,
+            ID_COUNT,
+            UNKNOWN = ID_COUNT
+        };
+
+        class View_t {
+        public:
+            View_t(const char *data = 0, size_t size = 0);
+
+            bool empty() const;
+
+            std::string str() const;
+
+            const char *data;
+            size_t size;
+        };
+
+        Headers_t();
+
+        static Id_t id(const char *name, size_t size);
+
+        static Id_t id(const std::string &name);
+
+        // first value, views are valid until the headers are modified
+        View_t operator[](Id_t id) const;
+
+        View_t operator[](const std::string &name) const;
+
+        // same interface as FRPC::HTTPHeader_t
+        int get(const std::string &name, std::string &value, int index = 0) const;
+
+        void add(const std::string &name, const std::string &value);
+
+        void set(const std::string &name, const std::string &value);
+
+        // negative index removes all values
+        void remove(const std::string &name, int index = 0);
+
+        size_t size() const;
+
+        View_t name(size_t index) const;
+
+        View_t value(size_t index) const;
+
+        // adds a "Name: value" line, folded lines continue the last value
+        void parse(const std::string &line);
+
+    private:
+        class Field_t {
+        public:
+            Id_t id;
+            size_t name;
+            size_t nameSize;
+            size_t value;
+            size_t valueSize;
+        };
+
+        enum { INLINE_FIELDS = 16 };
+
+        Field_t& field(size_t index);
+
+        const Field_t& field(size_t index) const;
+
+        bool matches(const Field_t &field, Id_t id, const std::string &name) const;
+
+        void push(const Field_t &field);
+
+        void erase(size_t index);
+
+        std::string buffer;
+        Field_t inlineFields[INLINE_FIELDS];
+        std::vector<Field_t> extraFields;
+        size_t count;
+        int first[ID_COUNT];
+    };
+
     class Message_t {
     public:
         Message_t(const std::string &protocol = "HTTP/1.0");
 
         int status;
         std::string protocol;
-        FRPC::HTTPHeader_t headers;
+        Headers_t headers;
         std::string contentType;
         std::string data;
     };
@@ -142,34 +248,241 @@ public:
         std::string unparsedUri;
         std::string uri;
         std::vector<std::string> matchGroups;
+        // query and multipart body parsed while reading, see parsesMultipart()
+        boost::shared_ptr<MimeParameters_t> form;
     };
 
     class Response_t : public Message_t {
     public:
-        Response_t(const Request_t &request);
+        class Buffer_t {
+        public:
+            Buffer_t(const char *data, size_t size);
+
+            Buffer_t(const boost::shared_ptr<const std::string> &owner);
+
+            const char *data;
+            size_t size;
+            boost::shared_ptr<const std::string> owner;
+        };
+
+        typedef std::vector<Buffer_t> Chain_t;
+
+        class FileRange_t {
+        public:
+            FileRange_t();
+
+            int fd;
+            off_t offset;
+            size_t size;
+            boost::shared_ptr<void> owner;
+        };
+
+        Response_t(const Request_t &request, ResponseWriter_t *writer = 0);
+
+        // borrowed memory must stay valid until the response is sent
+        Response_t& append(const char *data, size_t size);
+
+        Response_t& append(const boost::shared_ptr<const std::string> &data);
+
+        // sends the file range after data and chain using sendfile(2), owner
+        // keeps the descriptor open until then
+        Response_t& sendFile(int fd, off_t offset, size_t size,
+                             const boost::shared_ptr<void> &owner = boost::shared_ptr<void>());
+
+        size_t bodySize() const;
+
+        // sends headers on the first call, then streams the body in chunks
+        // (chunked for HTTP/1.1 without Content-Length, close-delimited
+        // otherwise); headers can't be changed afterwards
+        Response_t& write(const char *data, size_t size);
+
+        Response_t& write(const std::string &data);
+
+        void flush();
+
+        bool streaming() const;
 
         std::string statusMessage;
         std::string debugLogInfo;
         bool dontLog;
+        bool cacheable;
+        // validators for conditional GET, ETag defaults to a hash of the body
+        std::string etag;
+        time_t lastModified;
+        Chain_t chain;
+        FileRange_t file;
+
+    private:
+        ResponseWriter_t *writer;
     };
 
-    class Parameters_t {
+    class ResponseWriter_t {
     public:
-        typedef std::map<std::string, std::list<std::string> > Data_t;
+        ResponseWriter_t(size_t chunkSize);
+
+        // headOnly drops the body of the next response (HEAD requests)
+        void reset(int fd, int writeTimeout, bool headOnly = false);
+
+        void write(const Response_t &response);
+
+        void writeHead(const Response_t &response);
+
+        void writeChunk(const char *data, size_t size);
 
+        void flush();
+
+        void finish();
+
+        bool headSent() const;
+
+    private:
+        void formatHead(const Response_t &response, bool streaming);
+
+        void sendChunk(const char *data, size_t size);
+
+        void send(int flags = 0);
+
+        void sendFile(const Response_t::FileRange_t &file);
+
+        void waitWritable();
+
+        int fd;
+        int writeTimeout;
+        size_t chunkSize;
+        bool sentHead;
+        bool chunked;
+        bool headOnly;
+        std::string buffer;
+        std::string pending;
+        std::vector<struct iovec> iov;
+    };
+
+    class Compressor_t {
+    public:
+        Compressor_t(const std::vector<std::string> &contentTypes,
+                     const size_t minSize,
+                     const int level,
+                     const size_t cacheSize);
+
+        ~Compressor_t();
+
+        // replaces the body with its gzip encoding when the client accepts
+        // it, cacheable responses are compressed only once
+        void compress(const Request_t &request, Response_t &response);
+
+    private:
+        class Deflater_t;
+
+        class Entry_t {
+        public:
+            Entry_t();
+
+            boost::shared_ptr<const std::string> original;
+            boost::shared_ptr<const std::string> compressed;
+            std::list<uint64_t>::iterator lru;
+        };
+
+        typedef std::map<uint64_t, Entry_t> Cache_t;
+
+        bool compressible(const Response_t &response) const;
+
+        std::vector<std::string> contentTypes;
+        size_t minSize;
+        int level;
+        size_t cacheSize;
+        boost::thread_specific_ptr<Deflater_t> deflaters;
+        boost::mutex mutex;
+        Cache_t cache;
+        std::list<uint64_t> lru;
+        size_t cacheUsed;
+    };
+
+    class CachePolicy_t {
+    public:
+        CachePolicy_t(const time_t ttl,
+                      const time_t staleTtl = 0,
+                      const std::vector<std::string> &headers = std::vector<std::string>());
+
+        time_t ttl;
+        time_t staleTtl;
+        std::vector<std::string> headers;
+    };
+
+    class ResponseCache_t {
+    public:
+        enum Result_t {
+            MISS,
+            HIT,
+            STALE
+        };
+
+        class Stats_t {
+        public:
+            Stats_t();
+
+            size_t hits;
+            size_t staleHits;
+            size_t misses;
+            size_t stores;
+            size_t evictions;
+            size_t entries;
+            size_t size;
+        };
+
+        ResponseCache_t(const size_t maxSize, const size_t shardCount);
+
+        ~ResponseCache_t();
+
+        // includes the request headers named in the Vary of the last
+        // response stored for the URI
+        std::string key(const Request_t &request, const CachePolicy_t &policy);
+
+        // fills response on HIT and STALE, STALE means the caller should
+        // refresh the entry after answering
+        Result_t lookup(const std::string &key, Response_t &response);
+
+        // stores under the key of the response's Vary, which may differ
+        // from key; Vary: * isn't cached
+        void store(const Request_t &request, const std::string &key,
+                   const CachePolicy_t &policy, const Response_t &response);
+
+        void abandon(const std::string &key);
+
+        Stats_t stats() const;
+
+    private:
+        class Shard_t;
+
+        Shard_t& shard(const std::string &key);
+
+        size_t shardCount;
+        Shard_t *shards;
+    };
+
+    // name/value pairs are split on first access and values are decoded
+    // only when read; names and undecoded values point into the parsed data
+    class Parameters_t {
+    public:
         Parameters_t();
 
+        // copies params
         void parse(const std::string &params);
 
+        // data must outlive the parameters
+        void parse(const char *data, size_t size);
+
+        // parses the query string of an unparsed URI in place
+        void parseQuery(const std::string &unparsedUri);
+
         template<class T_t>
         boost::optional<T_t> getFirst(const std::string &name) const
         {
-            Data_t::const_iterator idata(data.find(name));
-            if (idata == data.end()) {
+            Range_t range(lookup(name));
+            if (range.first == range.second) {
                 return boost::optional<T_t>();
             } else {
                 return boost::optional<T_t>(lexical_cast<T_t>(
-                    idata->second.front(), name.c_str()));
+                    value(entries[*range.first]), name.c_str()));
             }
         }
 
@@ -177,82 +490,299 @@ public:
         std::list<T_t> get(const std::string &name) const
         {
             std::list<T_t> result;
-            Data_t::const_iterator idata(data.find(name));
-            if (idata == data.end()) {
-                return std::list<T_t>();
-            } else {
-                for (std::list<std::string>::const_iterator ilist(idata->second.begin()) ;
-                     ilist != idata->second.end() ;
-                     ++ilist) {
-
-                    result.push_back(lexical_cast<T_t>(
-                        *ilist, name.c_str()));
-                }
-                return result;
+            Range_t range(lookup(name));
+            for (const size_t *iorder(range.first) ; iorder != range.second ; ++iorder) {
+                result.push_back(lexical_cast<T_t>(
+                    value(entries[*iorder]), name.c_str()));
             }
+            return result;
         }
 
+        // name is a pattern like "items[][price]", each [] matches a
+        // numeric index; the first value wins for duplicate indexes
         template<class T_t>
         std::map<std::vector<size_t>, T_t> getIndexed(const std::string &name) const
         {
             std::map<std::vector<size_t>, T_t> result;
-            boost::regex regex(boost::algorithm::replace_all_copy(name, "[]", "\\[([0-9]+)\\]"));
-            for (Data_t::const_iterator idata(data.begin()) ;
-                 idata != data.end() ;
-                 ++idata) {
-
-                std::vector<size_t> indexes;
-                boost::cmatch matches;
-                if (!boost::regex_match(idata->first.c_str(), matches, regex)) {
-                    continue;
-                }
-
-                for (size_t i(1) ; i < matches.size() ; ++i) {
-                    indexes.push_back(boost::lexical_cast<size_t>(std::string(matches[i].first, matches[i].second)));
+            const Indexed_t *found(indexed(name));
+            if (found) {
+                for (Indexed_t::const_iterator ifound(found->begin()) ;
+                     ifound != found->end() ;
+                     ++ifound) {
+
+                    if (result.find(ifound->first) == result.end()) {
+                        result.insert(std::make_pair(ifound->first, lexical_cast<T_t>(
+                            value(entries[ifound->second]), name.c_str())));
+                    }
                 }
-
-                result.insert(std::make_pair(indexes, idata->second.front()));
             }
-
             return result;
         }
 
+        // typed accessors, false when missing or not convertible
+        bool getFirst(const std::string &name, std::string &value) const;
+
+        bool getFirst(const std::string &name, int &value) const;
+
+        bool getFirst(const std::string &name, long &value) const;
+
+        bool getFirst(const std::string &name, long long &value) const;
+
+        bool getFirst(const std::string &name, unsigned int &value) const;
+
+        bool getFirst(const std::string &name, unsigned long &value) const;
+
+        bool getFirst(const std::string &name, unsigned long long &value) const;
+
+        bool getFirst(const std::string &name, double &value) const;
+
+        bool getFirst(const std::string &name, bool &value) const;
+
+        bool has(const std::string &name) const;
+
+        size_t count(const std::string &name) const;
+
         bool getFirstBool(const std::string &name) const;
 
         std::list<bool> getBool(const std::string &name) const;
 
+        // builds the lookups done lazily on first access, the accessors
+        // don't modify the parameters afterwards and may be called from
+        // several threads at once
+        void index() const;
+
     protected:
+        class Entry_t {
+        public:
+            const char *name;
+            size_t nameSize;
+            const char *value;
+            size_t valueSize;
+            bool escaped;
+        };
+
+        // urlencoded data split lazily, or a single value when name is set
+        class Source_t {
+        public:
+            Source_t(const char *data, size_t size, const char *name = 0, size_t nameSize = 0);
+
+            const char *data;
+            size_t size;
+            const char *name;
+            size_t nameSize;
+        };
+
+        typedef std::pair<const size_t*, const size_t*> Range_t;
+
+        // indexes of names matching a pattern and the entry they belong to
+        typedef std::vector<std::pair<std::vector<size_t>, size_t> > Indexed_t;
+        typedef std::map<std::string, Indexed_t> IndexedMap_t;
+
+        // replaces numeric [N] in name by [], false if there is none
+        static bool splitIndexes(const char *name, size_t size,
+                                 std::string &pattern, std::vector<size_t> &indexes);
+
+        const Indexed_t* indexed(const std::string &pattern) const;
+
+        void indexNames() const;
+
+        // adds an already decoded value
+        void add(const std::string &name, const std::string &value);
+
+        // value must outlive the parameters
+        void add(const std::string &name, const char *value, size_t size);
+
+        void prepare() const;
+
+        Range_t lookup(const std::string &name) const;
+
+        const Entry_t* first(const std::string &name) const;
+
+        std::string value(const Entry_t &entry) const;
+
+        const std::string& own(const std::string &data) const;
+
+        // throws for invalid digits, unescape keeps a '%' not followed by
+        // two of them literally
         int unhex(const char c);
 
         std::string unescape(const std::string &s);
 
-        Data_t data;
+        std::vector<Source_t> sources;
+        mutable std::deque<std::string> owned;
+        mutable std::vector<Entry_t> entries;
+        mutable std::vector<size_t> order;
+        mutable size_t prepared;
+        mutable IndexedMap_t indexedEntries;
+        mutable size_t indexedCount;
+
+    private:
+        // entries point into sources and owned
+        Parameters_t(const Parameters_t&);
+        Parameters_t& operator=(const Parameters_t&);
+    };
+
+    // incremental multipart/form-data splitter, data passed to the sink
+    // points into the fed buffer (or into a carry buffer when a delimiter
+    // spans two feeds) and is valid only during the call
+    class MultipartParser_t {
+    public:
+        class Sink_t {
+        public:
+            virtual ~Sink_t();
+
+            virtual void partBegin(const Headers_t &headers) = 0;
+
+            virtual void partData(const char *data, size_t size) = 0;
+
+            virtual void partEnd() = 0;
+        };
+
+        MultipartParser_t(const std::string &boundary, Sink_t &sink,
+                          size_t maxHeaderSize = 16384);
+
+        // boundary parameter of a multipart Content-Type
+        static bool boundary(const std::string &contentType, std::string &boundary);
+
+        // throws HttpError_t(400) on malformed data
+        void feed(const char *data, size_t size);
+
+        // throws HttpError_t(400) unless the closing delimiter was seen
+        void finish();
+
+    private:
+        enum State_t {
+            PREAMBLE,
+            DELIMITER,
+            HEADERS,
+            BODY,
+            END
+        };
+
+        size_t process(const char *data, size_t size);
+
+        std::string delimiter;
+        Sink_t &sink;
+        size_t maxHeaderSize;
+        State_t state;
+        bool start;
+        std::string pending;
     };
 
     class MimeParameters_t : public Parameters_t {
     public:
         class File_t {
         public:
+            // part content, a view into the request body unless it had to
+            // be decoded or copied
+            class Data_t {
+            public:
+                Data_t();
+
+                Data_t(const char *data, size_t size,
+                       const boost::shared_ptr<const std::string> &owner
+                           = boost::shared_ptr<const std::string>());
+
+                const char* data() const;
+
+                size_t size() const;
+
+                bool empty() const;
+
+                const char* begin() const;
+
+                const char* end() const;
+
+                std::string str() const;
+
+                operator std::string() const;
+
+                friend std::ostream& operator<<(std::ostream &out, const Data_t &data)
+                {
+                    return out.write(data.data(), data.size());
+                }
+
+            private:
+                const char *pointer;
+                size_t length;
+                boost::shared_ptr<const std::string> owner;
+            };
+
             File_t();
 
-            std::string data;
+            // renames a spooled file (copies it across filesystems) or
+            // writes the data to path
+            void save(const std::string &path) const;
+
+            // empty for spooled files
+            Data_t data;
             std::string contentType;
             std::string filename;
+            // temporary file of a spooled part, removed with the last copy
+            // of the File_t unless saved
+            std::string path;
+            int fd;
+            size_t size;
+
+        private:
+            friend class MimeParameters_t;
+
+            class Spool_t;
+
+            boost::shared_ptr<Spool_t> spool;
         };
 
         typedef std::map<std::string, std::vector<File_t> > FileData_t;
 
         MimeParameters_t();
 
+        // splits the body in place, it must outlive the parameters
+        void parseMultipart(const std::string &contentType, const char *data, size_t size);
+
+        // copies params, which start with a Content-Type header
         void parseMime(const std::string &params);
 
+        // parses the body as it is read, file parts larger than spoolSize
+        // are written to temporary files in spoolDirectory, those with a
+        // Content-Transfer-Encoding are rejected with 413 instead
+        void beginMultipart(const std::string &contentType, size_t spoolSize,
+                            const std::string &spoolDirectory);
+
+        void feedMultipart(const char *data, size_t size);
+
+        void finishMultipart();
+
         const std::vector<File_t>& getFiles(const std::string &name) const;
 
         const std::map<std::vector<size_t>, const File_t&> getIndexedFiles(const std::string &name) const;
 
+        // indexes the files too, see Parameters_t::index()
+        void index() const;
+
     protected:
+        typedef std::map<std::string, std::vector<std::pair<std::vector<size_t>,
+                                                            const File_t*> > > IndexedFiles_t;
+
+        class Collector_t;
+
+        void indexFiles() const;
+
         FileData_t fileData;
         const std::vector<File_t> empty;
+        mutable IndexedFiles_t indexedFiles;
+        mutable bool filesIndexed;
+        boost::shared_ptr<Collector_t> collector;
+        boost::shared_ptr<MultipartParser_t> parser;
+    };
+
+    // work split into independent parts, see parallel()
+    class ParallelTask_t {
+    public:
+        virtual ~ParallelTask_t();
+
+        // called once for every index, possibly from several threads at
+        // once; must not throw
+        virtual void run(size_t index) = 0;
     };
 
     class Method_t {
@@ -262,6 +792,18 @@ public:
         virtual ~Method_t();
 
         virtual void call(const Request_t &request, Response_t &response) = 0;
+
+        // when true, body() receives request body fragments as they are
+        // read and request.data stays empty; such routes are limited by
+        // MaxStreamedBodySize (1 GiB) rather than MaxRequestSize
+        virtual bool streamsBody() const;
+
+        virtual void body(const Request_t &request, Response_t &response,
+                          const char *data, size_t size);
+
+        // when true, multipart/form-data bodies are parsed (and large files
+        // spooled) while reading into request.form instead of request.data
+        virtual bool parsesMultipart() const;
     };
 
     template<class Object_t>
@@ -296,6 +838,90 @@ public:
         return new BoundMethod_t<Object_t>(object, handler);
     }
 
+    template<class Object_t>
+    class StreamMethod_t : public Method_t {
+    public:
+        typedef void (Object_t::*BodyHandler_t)(const Request_t &request,
+                                                Response_t &response,
+                                                const char *data,
+                                                size_t size);
+        typedef void (Object_t::*Handler_t)(const Request_t &request, Response_t &response);
+
+        StreamMethod_t(Object_t &object, BodyHandler_t bodyHandler, Handler_t handler)
+          : Method_t(),
+            object(object),
+            bodyHandler(bodyHandler),
+            handler(handler)
+        {
+        }
+
+        virtual ~StreamMethod_t()
+        {
+        }
+
+        virtual bool streamsBody() const
+        {
+            return true;
+        }
+
+        virtual void body(const Request_t &request, Response_t &response,
+                          const char *data, size_t size)
+        {
+            (object.*bodyHandler)(request, response, data, size);
+        }
+
+        virtual void call(const Request_t &request, Response_t &response)
+        {
+            return (object.*handler)(request, response);
+        }
+
+    private:
+        Object_t &object;
+        BodyHandler_t bodyHandler;
+        Handler_t handler;
+    };
+
+    template<class Object_t>
+    static StreamMethod_t<Object_t>* streamMethod(typename StreamMethod_t<Object_t>::BodyHandler_t bodyHandler,
+                                                  typename StreamMethod_t<Object_t>::Handler_t handler,
+                                                  Object_t &object)
+    {
+        return new StreamMethod_t<Object_t>(object, bodyHandler, handler);
+    }
+
+    class StaticMethod_t : public Method_t {
+    public:
+        StaticMethod_t(const std::string &documentRoot,
+                       const size_t cacheSize,
+                       const time_t revalidateTimeout);
+
+        virtual ~StaticMethod_t();
+
+        virtual void call(const Request_t &request, Response_t &response);
+
+    private:
+        class File_t;
+
+        typedef std::list<std::string> Lru_t;
+        typedef std::map<std::string, std::pair<boost::shared_ptr<File_t>, Lru_t::iterator> > Cache_t;
+
+        boost::shared_ptr<File_t> open(const std::string &path);
+
+        std::string documentRoot;
+        size_t cacheSize;
+        time_t revalidateTimeout;
+        boost::mutex mutex;
+        Cache_t cache;
+        Lru_t lru;
+    };
+
+    static StaticMethod_t* staticMethod(const std::string &documentRoot,
+                                        const size_t cacheSize = 1024,
+                                        const time_t revalidateTimeout = 1)
+    {
+        return new StaticMethod_t(documentRoot, cacheSize, revalidateTimeout);
+    }
+
     template<class Object_t>
     class HttpMethod_t : public Method_t {
     public:
@@ -317,19 +943,9 @@ public:
         virtual void call(const Request_t &request, Response_t &response)
         {
             Parameters_t params;
-            size_t pos(request.unparsedUri.find("?"));
-            size_t pos2(request.unparsedUri.find("#"));
-            if (pos != std::string::npos) {
-                if (pos2 != std::string::npos) {
-                    if (pos2 > pos) {
-                        params.parse(request.unparsedUri.substr(pos+1, pos2));
-                    }
-                } else {
-                    params.parse(request.unparsedUri.substr(pos+1));
-                }
-            }
+            params.parseQuery(request.unparsedUri);
             if (request.method == "POST" || request.method == "PUT") {
-                params.parse(request.data);
+                params.parse(request.data.data(), request.data.size());
             }
             try {
                 (object.*handler)(request, response, params);
@@ -371,25 +987,24 @@ public:
         {
         }
 
+        virtual bool parsesMultipart() const
+        {
+            return true;
+        }
+
         virtual void call(const Request_t &request, Response_t &response)
         {
-            MimeParameters_t params;
-            size_t pos(request.unparsedUri.find("?"));
-            size_t pos2(request.unparsedUri.find("#"));
-            if (pos != std::string::npos) {
-                if (pos2 != std::string::npos) {
-                    if (pos2 > pos) {
-                        params.parse(request.unparsedUri.substr(pos+1, pos2));
+            MimeParameters_t parsed;
+            const MimeParameters_t &params(request.form ? *request.form : parsed);
+            if (!request.form) {
+                parsed.parseQuery(request.unparsedUri);
+                if (request.method == "POST" || request.method == "PUT") {
+                    if (request.contentType.find("multipart/form-data") == 0) {
+                        parsed.parseMultipart(request.contentType,
+                                              request.data.data(), request.data.size());
+                    } else {
+                        parsed.parse(request.data.data(), request.data.size());
                     }
-                } else {
-                    params.parse(request.unparsedUri.substr(pos+1));
-                }
-            }
-            if (request.method == "POST" || request.method == "PUT") {
-                if (request.contentType.find("multipart/form-data") == 0) {
-                    params.parseMime("Content-Type: " + request.contentType + "\r\n\r\n" + request.data);
-                } else {
-                    params.parse(request.data);
                 }
             }
             try {
@@ -436,26 +1051,17 @@ public:
         virtual void call(const Request_t &request, Response_t &response)
         {
             Parameters_t params;
-            size_t pos(request.unparsedUri.find("?"));
-            size_t pos2(request.unparsedUri.find("#"));
-            if (pos != std::string::npos) {
-                if (pos2 != std::string::npos) {
-                    if (pos2 > pos) {
-                        params.parse(request.unparsedUri.substr(pos+1, pos2));
-                    }
-                } else {
-                    params.parse(request.unparsedUri.substr(pos+1));
-                }
-            }
+            params.parseQuery(request.unparsedUri);
             if (request.method == "POST" || request.method == "PUT") {
-                params.parse(request.data);
+                params.parse(request.data.data(), request.data.size());
             }
-            response.contentType = "application/json; charset=utf-8";
+            JSON::Encoding encoding(negotiateEncoding(request, response));
             JSON::Pool_t pool;
             try {
                 JSON::Value_t &result((object.*handler)(pool, request, response, params));
-                response.data = std::string(result);
-                if (logCheckLevel(DBG1)) {
+                response.data.clear();
+                result.serialize(response.data, encoding);
+                if (encoding == JSON::JsonEncoding && logCheckLevel(DBG1)) {
                     if (response.debugLogInfo.empty()) {
                         LOG(DBG1, "Response:\n%s\n",
                             response.data.c_str());
@@ -503,33 +1109,33 @@ public:
         {
         }
 
+        virtual bool parsesMultipart() const
+        {
+            return true;
+        }
+
         virtual void call(const Request_t &request, Response_t &response)
         {
-            MimeParameters_t params;
-            size_t pos(request.unparsedUri.find("?"));
-            size_t pos2(request.unparsedUri.find("#"));
-            if (pos != std::string::npos) {
-                if (pos2 != std::string::npos) {
-                    if (pos2 > pos) {
-                        params.parse(request.unparsedUri.substr(pos+1, pos2));
+            MimeParameters_t parsed;
+            const MimeParameters_t &params(request.form ? *request.form : parsed);
+            if (!request.form) {
+                parsed.parseQuery(request.unparsedUri);
+                if (request.method == "POST" || request.method == "PUT") {
+                    if (request.contentType.find("multipart/form-data") == 0) {
+                        parsed.parseMultipart(request.contentType,
+                                              request.data.data(), request.data.size());
+                    } else {
+                        parsed.parse(request.data.data(), request.data.size());
                     }
-                } else {
-                    params.parse(request.unparsedUri.substr(pos+1));
-                }
-            }
-            if (request.method == "POST" || request.method == "PUT") {
-                if (request.contentType.find("multipart/form-data") == 0) {
-                    params.parseMime("Content-Type: " + request.contentType + "\r\n\r\n" + request.data);
-                } else {
-                    params.parse(request.data);
                 }
             }
-            response.contentType = "application/json; charset=utf-8";
+            JSON::Encoding encoding(negotiateEncoding(request, response));
             JSON::Pool_t pool;
             try {
                 JSON::Value_t &result((object.*handler)(pool, request, response, params));
-                response.data = std::string(result);
-                if (logCheckLevel(DBG1)) {
+                response.data.clear();
+                result.serialize(response.data, encoding);
+                if (encoding == JSON::JsonEncoding && logCheckLevel(DBG1)) {
                     if (response.debugLogInfo.empty()) {
                         LOG(DBG1, "Response:\n%s\n",
                             response.data.c_str());
@@ -581,22 +1187,33 @@ public:
         {
             if (request.method != "POST") {
                 LOG(ERR2, "Method isn't POST for pure JSON method");
-                throw HttpError_t(405);
+                throw HttpError_t(405, "Method %s not allowed", request.method.c_str());
             }
 
             Json::Value value;
-            Json::Reader reader;
-            if (!reader.parse(request.data, value)) {
-                LOG(ERR2, "Couldn't parse JSON data '%s'", request.data.c_str());
-                throw HttpError_t(400);
+            JSON::Encoding bodyEncoding(JSON::contentEncoding(request.contentType));
+            if (bodyEncoding != JSON::JsonEncoding) {
+                try {
+                    JSON::decode(request.data.data(), request.data.size(), bodyEncoding, value);
+                } catch (const Error_t &e) {
+                    LOG(ERR2, "Couldn't decode request data: %s", e.what());
+                    throw HttpError_t(400, e.what());
+                }
+            } else {
+                Json::Reader reader;
+                if (!reader.parse(request.data, value)) {
+                    LOG(ERR2, "Couldn't parse JSON data '%s'", request.data.c_str());
+                    throw HttpError_t(400, "Couldn't parse JSON data");
+                }
             }
 
-            response.contentType = "application/json; charset=utf-8";
+            JSON::Encoding encoding(negotiateEncoding(request, response));
             JSON::Pool_t pool;
             try {
                 JSON::Value_t &result((object.*handler)(pool, request, response, value));
-                response.data = std::string(result);
-                if (logCheckLevel(DBG1)) {
+                response.data.clear();
+                result.serialize(response.data, encoding);
+                if (encoding == JSON::JsonEncoding && logCheckLevel(DBG1)) {
                     if (response.debugLogInfo.empty()) {
                         LOG(DBG1, "Response:\n%s\n",
                             response.data.c_str());
@@ -625,6 +1242,344 @@ public:
         return new JsonRPCMethod_t<Object_t>(object, handler);
     }
 
+    // like JsonRPCMethod_t, the body is parsed into a flat per-request
+    // document instead of a Json::Value tree
+    template<class Object_t>
+    class JsonRPCMethod2_t : public Method_t {
+    public:
+        typedef JSON::Value_t& (Object_t::*Handler_t)(JSON::Pool_t &pool,
+                                                      const Request_t &request,
+                                                      Response_t &response,
+                                                      const JSON::Node_t &data);
+
+        JsonRPCMethod2_t(Object_t &object, Handler_t handler)
+          : Method_t(),
+            object(object),
+            handler(handler)
+        {
+        }
+
+        virtual ~JsonRPCMethod2_t()
+        {
+        }
+
+        virtual void call(const Request_t &request, Response_t &response)
+        {
+            if (request.method != "POST") {
+                LOG(ERR2, "Method isn't POST for pure JSON method");
+                throw HttpError_t(405, "Method %s not allowed", request.method.c_str());
+            }
+
+            JSON::Document_t document;
+            try {
+                document.parse(request.data);
+            } catch (const Error_t &e) {
+                LOG(ERR2, "Couldn't parse JSON data: %s", e.what());
+                throw HttpError_t(400, e.what());
+            }
+
+            JSON::Encoding encoding(negotiateEncoding(request, response));
+            JSON::Pool_t pool;
+            try {
+                JSON::Value_t &result((object.*handler)(pool, request, response, document.root()));
+                response.data.clear();
+                result.serialize(response.data, encoding);
+                if (encoding == JSON::JsonEncoding && logCheckLevel(DBG1)) {
+                    if (response.debugLogInfo.empty()) {
+                        LOG(DBG1, "Response:\n%s\n",
+                            response.data.c_str());
+                    } else {
+                        LOG(DBG1, "[%s] Response:\n%s\n",
+                            response.debugLogInfo.c_str(), response.data.c_str());
+                    }
+                }
+            } catch (const HttpError_t &e) {
+                if (e.code() / 100 >= 4) {
+                    throw e;
+                } else {
+                    response.status = e.code();
+                }
+            }
+        }
+
+    private:
+        Object_t &object;
+        Handler_t handler;
+    };
+
+    template<class Object_t>
+    static JsonRPCMethod2_t<Object_t>* jsonRPCMethod2(typename JsonRPCMethod2_t<Object_t>::Handler_t handler, Object_t &object)
+    {
+        return new JsonRPCMethod2_t<Object_t>(object, handler);
+    }
+
+    // like JsonRPCMethod2_t for structs bound with JSON_BIND_BEGIN (see
+    // jsonbind.h), the body is parsed into Params_t and the handler fills
+    // Result_t, which is serialized without building JSON::Value_t trees
+    template<class Object_t, class Params_t, class Result_t>
+    class JsonRPCBoundMethod_t : public Method_t {
+    public:
+        typedef void (Object_t::*Handler_t)(const Request_t &request,
+                                            Response_t &response,
+                                            const Params_t &params,
+                                            Result_t &result);
+
+        JsonRPCBoundMethod_t(Object_t &object, Handler_t handler)
+          : Method_t(),
+            object(object),
+            handler(handler)
+        {
+        }
+
+        virtual ~JsonRPCBoundMethod_t()
+        {
+        }
+
+        virtual void call(const Request_t &request, Response_t &response)
+        {
+            if (request.method != "POST") {
+                LOG(ERR2, "Method isn't POST for pure JSON method");
+                throw HttpError_t(405, "Method %s not allowed", request.method.c_str());
+            }
+
+            Params_t params;
+            try {
+                JSON::Document_t document;
+                document.parse(request.data);
+                JSON::parse(document.root(), params);
+            } catch (const Error_t &e) {
+                LOG(ERR2, "Couldn't parse JSON data: %s", e.what());
+                throw HttpError_t(400, e.what());
+            }
+
+            response.contentType = "application/json; charset=utf-8";
+            try {
+                Result_t result;
+                (object.*handler)(request, response, params, result);
+                response.data.clear();
+                JSON::serialize(result, response.data);
+                if (logCheckLevel(DBG1)) {
+                    if (response.debugLogInfo.empty()) {
+                        LOG(DBG1, "Response:\n%s\n",
+                            response.data.c_str());
+                    } else {
+                        LOG(DBG1, "[%s] Response:\n%s\n",
+                            response.debugLogInfo.c_str(), response.data.c_str());
+                    }
+                }
+            } catch (const HttpError_t &e) {
+                if (e.code() / 100 >= 4) {
+                    throw e;
+                } else {
+                    response.status = e.code();
+                }
+            }
+        }
+
+    private:
+        Object_t &object;
+        Handler_t handler;
+    };
+
+    template<class Object_t, class Params_t, class Result_t>
+    static JsonRPCBoundMethod_t<Object_t, Params_t, Result_t>* jsonRPCBoundMethod(void (Object_t::*handler)(const Request_t&, Response_t&, const Params_t&, Result_t&), Object_t &object)
+    {
+        return new JsonRPCBoundMethod_t<Object_t, Params_t, Result_t>(object, handler);
+    }
+
+    // like JsonRPCMethod2_t, a JSON-RPC 2.0 batch (top level array) is split
+    // and every call is passed to the handler on its own; the calls run in
+    // parallel on the BatchWorkers and the results keep the batch order,
+    // notifications (calls without an id) give no result. The handler
+    // returns the result only, it is wrapped in the response object here.
+    // Batch calls get a Response_t of their own which is dropped (status,
+    // headers and dontLog set there are lost) and the batch is answered in
+    // JSON; a single call uses the request's response and negotiateEncoding
+    template<class Object_t>
+    class JsonRPCBatchMethod_t : public Method_t {
+    public:
+        typedef JSON::Value_t& (Object_t::*Handler_t)(JSON::Pool_t &pool,
+                                                      const Request_t &request,
+                                                      Response_t &response,
+                                                      const JSON::Node_t &data);
+
+        JsonRPCBatchMethod_t(CppHttpHandler_t &httpHandler, Object_t &object, Handler_t handler)
+          : Method_t(),
+            httpHandler(httpHandler),
+            object(object),
+            handler(handler)
+        {
+        }
+
+        virtual ~JsonRPCBatchMethod_t()
+        {
+        }
+
+        virtual void call(const Request_t &request, Response_t &response)
+        {
+            if (request.method != "POST") {
+                LOG(ERR2, "Method isn't POST for pure JSON method");
+                throw HttpError_t(405, "Method %s not allowed", request.method.c_str());
+            }
+
+            JSON::Document_t document;
+            try {
+                document.parse(request.data);
+            } catch (const Error_t &e) {
+                LOG(ERR2, "Couldn't parse JSON data: %s", e.what());
+                throw HttpError_t(400, e.what());
+            }
+
+            JSON::Encoding encoding(JSON::JsonEncoding);
+            JSON::Node_t root(document.root());
+            if (root.getType() == JSON::ArrayType) {
+                response.contentType = "application/json; charset=utf-8";
+                if (!root.size()) {
+                    response.data = error(JSON::Node_t(), -32600, "Invalid Request");
+                } else {
+                    // the calls share the request
+                    if (request.form) {
+                        request.form->index();
+                    }
+                    Batch_t batch(*this, request, root);
+                    httpHandler.parallel(batch, root.size());
+                    response.data = batch.result();
+                    if (response.data.empty()) {
+                        response.status = 204;
+                    }
+                }
+            } else if (root.getType() != JSON::StructType) {
+                encoding = negotiateEncoding(request, response);
+                response.data = error(JSON::Node_t(), -32600, "Invalid Request", encoding);
+            } else {
+                encoding = negotiateEncoding(request, response);
+                JSON::Pool_t pool;
+                try {
+                    JSON::Value_t &result((object.*handler)(pool, request, response, root));
+                    response.data.clear();
+                    if (root.has("id")) {
+                        envelope(pool, result, root["id"]).serialize(response.data, encoding);
+                    } else {
+                        response.status = 204;
+                    }
+                } catch (const HttpError_t &e) {
+                    if (e.code() / 100 >= 4) {
+                        throw e;
+                    } else {
+                        response.status = e.code();
+                    }
+                }
+            }
+
+            if (encoding == JSON::JsonEncoding && logCheckLevel(DBG1)) {
+                if (response.debugLogInfo.empty()) {
+                    LOG(DBG1, "Response:\n%s\n",
+                        response.data.c_str());
+                } else {
+                    LOG(DBG1, "[%s] Response:\n%s\n",
+                        response.debugLogInfo.c_str(), response.data.c_str());
+                }
+            }
+        }
+
+    private:
+        class Batch_t : public ParallelTask_t {
+        public:
+            Batch_t(JsonRPCBatchMethod_t &method, const Request_t &request,
+                    const JSON::Node_t &calls)
+              : method(method),
+                request(request),
+                calls(calls.begin(), calls.end()),
+                results(calls.size())
+            {
+            }
+
+            virtual void run(size_t index)
+            {
+                results[index] = method.callOne(request, calls[index]);
+            }
+
+            std::string result() const
+            {
+                std::string data;
+                for (std::vector<std::string>::const_iterator iresults(results.begin()) ;
+                     iresults != results.end() ;
+                     ++iresults) {
+
+                    if (!iresults->empty()) {
+                        data.append(data.empty() ? "[" : ",");
+                        data.append(*iresults);
+                    }
+                }
+                if (!data.empty()) {
+                    data.append("]");
+                }
+                return data;
+            }
+
+        private:
+            JsonRPCBatchMethod_t &method;
+            const Request_t &request;
+            const std::vector<JSON::Node_t> calls;
+            std::vector<std::string> results;
+        };
+
+        std::string callOne(const Request_t &request, const JSON::Node_t &call)
+        {
+            if (call.getType() != JSON::StructType) {
+                return error(JSON::Node_t(), -32600, "Invalid Request");
+            }
+
+            std::string message;
+            try {
+                JSON::Pool_t pool;
+                Response_t response(request);
+                JSON::Value_t &result((object.*handler)(pool, request, response, call));
+                return call.has("id") ? std::string(envelope(pool, result, call["id"])) : std::string();
+            } catch (const std::exception &e) {
+                message = e.what();
+            } catch (...) {
+                message = "Unknown error";
+            }
+            LOG(ERR2, "JSON-RPC call failed: %s", message.c_str());
+            return call.has("id") ? error(call["id"], -32603, message) : std::string();
+        }
+
+        static JSON::Value_t& envelope(JSON::Pool_t &pool, const JSON::Value_t &result,
+                                       const JSON::Node_t &id)
+        {
+            return pool.Struct().append(
+                "jsonrpc", pool.String("2.0")).append(
+                "result", result).append(
+                "id", id.copy(pool));
+        }
+
+        static std::string error(const JSON::Node_t &id, int code, const std::string &message,
+                                 JSON::Encoding encoding = JSON::JsonEncoding)
+        {
+            JSON::Pool_t pool;
+            const JSON::Value_t &result(pool.Struct().append(
+                "jsonrpc", pool.String("2.0")).append(
+                "error", pool.Struct().append(
+                    "code", pool.Int(code)).append(
+                    "message", pool.String(message))).append(
+                "id", id.copy(pool)));
+            std::string data;
+            result.serialize(data, encoding);
+            return data;
+        }
+
+        CppHttpHandler_t &httpHandler;
+        Object_t &object;
+        Handler_t handler;
+    };
+
+    template<class Object_t>
+    static JsonRPCBatchMethod_t<Object_t>* jsonRPCBatchMethod(CppHttpHandler_t &httpHandler, typename JsonRPCBatchMethod_t<Object_t>::Handler_t handler, Object_t &object)
+    {
+        return new JsonRPCBatchMethod_t<Object_t>(httpHandler, object, handler);
+    }
+
     CppHttpHandler_t(ThreadServer_t *threadServer,
                      const std::string &name,
                      const size_t workerCount);
@@ -641,11 +1596,60 @@ public:
     void registerMethod(const std::string &location,
                         Method_t *method);
 
+    void registerMethod(const std::string &location,
+                        Method_t *method,
+                        const CachePolicy_t &cachePolicy);
+
+    // limits request bodies of the route last registered at location,
+    // MaxRequestSize applies otherwise (MaxStreamedBodySize to methods that
+    // stream the body), 0 means unlimited
+    void setMaxBodySize(const std::string &location, size_t maxBodySize);
+
+    ResponseCache_t::Stats_t responseCacheStats() const;
+
+    // shared by all workers of this handler, see JSON::Pool_t::Raw
+    JSON::FragmentCache_t& fragmentCache();
+
+    // JSON, MessagePack or CBOR as the Accept header of request asks (see
+    // JSON::acceptedEncoding), sets the content type and Vary of response
+    static JSON::Encoding negotiateEncoding(const Request_t &request, Response_t &response);
+
+    // runs task.run(0) .. task.run(count - 1) on the BatchWorkers and the
+    // calling thread, returns when all of them are done
+    void parallel(ParallelTask_t &task, size_t count);
+
+    // 0 while a stale cached response is refreshed in the background
     SocketWork_t* getWork();
 
 private:
     typedef Module_t* (*ModuleCreateFunction_t)(CppHttpHandler_t*);
 
+    class Route_t {
+    public:
+        Route_t(const std::string &location, Method_t *method, size_t maxBodySize);
+
+        boost::regex location;
+        Method_t *method;
+        size_t maxBodySize;
+        boost::optional<CachePolicy_t> cachePolicy;
+    };
+
+    typedef std::list<Route_t> MethodRegistry_t;
+
+    class Batch_t;
+    class Refresh_t;
+
+    void runBatchWorker();
+
+    // first route of the calling thread matching the URI, fills matchGroups
+    Route_t* findRoute(Request_t &request);
+
+    // recomputes a stale cached response on a batch worker, or right away
+    // without BatchWorkers
+    void refreshLater(const Request_t &request, const std::string &cacheKey);
+
+    void refresh(Request_t &request, const std::string &cacheKey);
+
     class DlHandleGuard_t {
     public:
         DlHandleGuard_t(void *handle = 0);
@@ -660,14 +1664,33 @@ private:
         void *handle;
     };
 
+    // declared before the module, which may hold on to it until destroyed
+    JSON::FragmentCache_t fragments;
     DlHandleGuard_t moduleHandle;
     std::auto_ptr<Module_t> module;
     boost::thread_specific_ptr<SocketWork_t> work;
     time_t readTimeout;
     time_t writeTimeout;
     size_t maxLineSize;
+    // default body limit of routes, 0 means unlimited (it used to be passed
+    // to FRPC::HTTPIO_t as is)
     size_t maxRequestSize;
-    boost::thread_specific_ptr<std::list<std::pair<boost::regex, Method_t*> > > methodRegistry;
+    size_t maxStreamedBodySize;
+    size_t maxHeaderLines;
+    size_t streamChunkSize;
+    bool autoETag;
+    size_t multipartSpoolSize;
+    std::string multipartSpoolDirectory;
+    std::auto_ptr<Compressor_t> compressor;
+    // created by the first route with a cache policy, 0 disables caching
+    size_t responseCacheSize;
+    size_t responseCacheShards;
+    mutable boost::mutex responseCacheMutex;
+    std::auto_ptr<ResponseCache_t> responseCache;
+    boost::thread_specific_ptr<MethodRegistry_t> methodRegistry;
+    boost::thread_specific_ptr<ResponseWriter_t> responseWriter;
+    std::vector<boost::thread*> batchWorkers;
+    threading::queue<boost::shared_ptr<Batch_t> > batchQueue;
 };
 
 } // namespace ThreadServer
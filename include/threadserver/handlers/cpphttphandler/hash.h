@@ -0,0 +1,15 @@
+
+#ifndef THREADSERVER_HANDLER_CPP_HTTP_HASH_H
+#define THREADSERVER_HANDLER_CPP_HTTP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ThreadServer {
+
+// XXH64, chain buffers by passing the previous result as seed
+uint64_t hash64(const char *data, size_t size, uint64_t seed = 0);
+
+} // namespace ThreadServer
+
+#endif // THREADSERVER_HANDLER_CPP_HTTP_HASH_H
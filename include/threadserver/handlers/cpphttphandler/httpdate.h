@@ -0,0 +1,18 @@
+
+#ifndef THREADSERVER_HANDLER_CPP_HTTP_HTTPDATE_H
+#define THREADSERVER_HANDLER_CPP_HTTP_HTTPDATE_H
+
+#include <time.h>
+#include <string>
+
+namespace ThreadServer {
+
+// RFC 1123 date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string formatHttpDate(time_t time);
+
+// accepts RFC 1123, RFC 850 and asctime formats
+bool parseHttpDate(const std::string &date, time_t &time);
+
+} // namespace ThreadServer
+
+#endif // THREADSERVER_HANDLER_CPP_HTTP_HTTPDATE_H
@@ -2,10 +2,13 @@
 #ifndef JSON_H
 #define JSON_H
 
-#include <list>
+#include <stddef.h>
+#include <stdint.h>
 #include <map>
 #include <string>
 #include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <jsoncpp/value.h>
 #include <threadserver/error.h>
 
@@ -19,65 +22,83 @@ enum Type {
     DoubleType,
     BoolType,
     StructType,
-    ArrayType
+    ArrayType,
+    RawType
 };
 
+enum Encoding {
+    JsonEncoding = 0,
+    MessagePackEncoding,
+    CborEncoding
+};
+
+class Pool_t;
+class Encoder_t;
+
+// values live in the memory of the Pool_t that created them; they have no
+// vtable, the type tag selects the layout
 class Value_t {
+friend class Encoder_t;
 protected:
-    Value_t();
+    Value_t(const Type type);
 
 public:
-    virtual ~Value_t() = 0;
+    Type getType() const;
+
+    bool isNull() const;
+
+    operator std::string() const;
 
-    virtual Type getType() const = 0;
+    // appends the serialized value, the whole tree is written in one pass
+    void serialize(std::string &output) const;
 
-    virtual bool isNull() const;
+    // appends the value as JSON, MessagePack or CBOR
+    void serialize(std::string &output, const Encoding encoding) const;
 
-    virtual operator std::string() const = 0;
+protected:
+    const Type type;
 };
 
 class Null_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
     Null_t();
 
 public:
-    virtual ~Null_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 };
 
+// data is either raw text escaped on serialization or, for escaped strings,
+// text already escaped for JSON (without the quotes)
 class String_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
-    String_t(const std::string &data);
+    String_t(const char *data, const size_t size, const bool escaped);
 
 public:
-    virtual ~String_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 
     static std::string escape(const std::string &s);
 
+    // appends the quoted and escaped string
+    static void escape(const char *data, size_t size, std::string &output);
+
 protected:
-    const std::string data;
+    const char *data;
+    size_t size;
+    bool escaped;
 };
 
 class Int_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
     Int_t(const long long data);
 
 public:
-    virtual ~Int_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 
 protected:
     const long long data;
@@ -85,15 +106,12 @@ protected:
 
 class Double_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
     Double_t(const double data);
 
 public:
-    virtual ~Double_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 
 protected:
     const double data;
@@ -101,56 +119,99 @@ protected:
 
 class Bool_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
     Bool_t(const bool data);
 
 public:
-    virtual ~Bool_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 
 protected:
     const bool data;
 };
 
+// members keep insertion order, names are stored escaped; appending an
+// existing name replaces its value in place
 class Struct_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
-    Struct_t();
+    Struct_t(Pool_t &pool);
 
 public:
-    virtual ~Struct_t();
-
-    virtual Type getType() const;
-
-    virtual operator std::string() const;
+    void serialize(std::string &output) const;
 
     Struct_t& append(const std::string &name, const Value_t &value);
 
+    Struct_t& append(const char *name, size_t nameSize, const Value_t &value);
+
 protected:
-    std::map<std::string, const Value_t*> data;
+    struct Member_t {
+        const char *name;
+        size_t nameSize;
+        uint64_t hash;
+        const Value_t *value;
+    };
+
+    // escaped name in pool.scratch
+    Member_t* find(uint64_t hash);
+
+    void indexMember(size_t position);
+
+    Pool_t &pool;
+    Member_t *members;
+    size_t size;
+    size_t capacity;
+    // open addressing over member positions + 1, built for larger structs
+    size_t *index;
+    size_t indexSize;
 };
 
 class Array_t : public Value_t {
 friend class Pool_t;
+friend class Encoder_t;
 protected:
-    Array_t();
+    Array_t(Pool_t &pool);
 
 public:
-    virtual ~Array_t();
+    void serialize(std::string &output) const;
 
-    virtual Type getType() const;
+    Array_t& push_back(const Value_t &value);
 
-    virtual operator std::string() const;
+protected:
+    Pool_t &pool;
+    const Value_t **values;
+    size_t size;
+    size_t capacity;
+};
 
-    Array_t& push_back(const Value_t &value);
+// already serialized JSON written verbatim, e.g. a fragment from the
+// FragmentCache_t; the text is not validated
+class Raw_t : public Value_t {
+friend class Pool_t;
+friend class Encoder_t;
+protected:
+    Raw_t(const char *data, const size_t size);
+
+public:
+    void serialize(std::string &output) const;
 
 protected:
-    std::vector<const Value_t*> data;
+    const char *data;
+    size_t size;
+};
+
+// one published, serialized subtree
+class Fragment_t {
+public:
+    Fragment_t(const std::string &data, const unsigned long long version);
+
+    const std::string data;
+    const unsigned long long version;
 };
 
+// bump allocator for the values of one response; its memory goes back to a
+// per-thread cache and is reused by the next pool on the same thread
 class Pool_t {
 public:
     Pool_t();
@@ -161,6 +222,18 @@ public:
 
     String_t& String(const std::string &data);
 
+    String_t& String(const char *data, size_t size);
+
+    // references data instead of copying it, the caller keeps it alive and
+    // unchanged until the pool is cleared (request buffers, static datasets)
+    String_t& BorrowedString(const std::string &data);
+
+    String_t& BorrowedString(const char *data, size_t size);
+
+    // borrowed like BorrowedString, data is already escaped and is written
+    // between the quotes verbatim
+    String_t& EscapedString(const char *data, size_t size);
+
     Int_t& Int(const long long data);
 
     Double_t& Double(const double data);
@@ -171,12 +244,102 @@ public:
 
     Array_t& Array();
 
+    // references data like BorrowedString
+    Raw_t& Raw(const char *data, size_t size);
+
+    Raw_t& Raw(const std::string &data);
+
+    // the pool keeps the fragment alive until it is cleared
+    Raw_t& Raw(const boost::shared_ptr<const Fragment_t> &fragment);
+
+    // invalidates all values created so far
+    void clear();
+
+    // 8-byte aligned, valid until clear() or destruction
+    void* allocate(size_t size);
+
+    // copies data into the pool
+    const char* copy(const char *data, size_t size);
+
 protected:
-    std::list<Value_t*> values;
+    friend class Struct_t;
+
+    class Chunk_t;
+
+    Pool_t(const Pool_t&);
+    Pool_t& operator=(const Pool_t&);
+
+    void grow(size_t size);
+
+    Chunk_t *chunks;
+    char *position;
+    char *end;
+    size_t chunkSize;
+    std::string scratch;
+    std::vector<boost::shared_ptr<const Fragment_t> > fragments;
 
     Null_t null;
 };
 
+// serialized subtrees shared by all threads (category lists, configuration
+// blobs) so that hot responses embed them with Pool_t::Raw instead of
+// rebuilding them; versions only go forward
+class FragmentCache_t {
+public:
+    FragmentCache_t();
+
+    // serializes value and stores it unless the cache already holds the same
+    // or a newer version, returns the fragment held afterwards
+    boost::shared_ptr<const Fragment_t> publish(const std::string &name,
+                                                const unsigned long long version,
+                                                const Value_t &value);
+
+    // data must be valid JSON
+    boost::shared_ptr<const Fragment_t> publish(const std::string &name,
+                                                const unsigned long long version,
+                                                const std::string &data);
+
+    // empty when missing or older than version
+    boost::shared_ptr<const Fragment_t> fetch(const std::string &name,
+                                              const unsigned long long version = 0) const;
+
+    void remove(const std::string &name);
+
+private:
+    typedef std::map<std::string, boost::shared_ptr<const Fragment_t> > Fragments_t;
+
+    FragmentCache_t(const FragmentCache_t&);
+    FragmentCache_t& operator=(const FragmentCache_t&);
+
+    boost::shared_ptr<const Fragment_t> store(const std::string &name,
+                                              const boost::shared_ptr<const Fragment_t> &fragment);
+
+    mutable boost::mutex mutex;
+    Fragments_t fragments;
+};
+
+// MessagePack for application/msgpack, application/x-msgpack and
+// application/vnd.msgpack, CBOR for application/cbor, JSON otherwise
+Encoding contentEncoding(const std::string &contentType);
+
+// the JSON, MessagePack or CBOR type with the highest q in an Accept header,
+// the first one listed on ties, JSON when none is listed
+Encoding acceptedEncoding(const std::string &accept);
+
+const char* contentType(const Encoding encoding);
+
+// decodes a MessagePack or CBOR document, throws Error_t on invalid input
+void decode(const char *data, size_t size, const Encoding encoding, Json::Value &value);
+
+// appends the decimal value
+void appendInt(std::string &output, long long value);
+
+void appendUnsigned(std::string &output, unsigned long long value);
+
+// appends the shortest representation that reads back as value (Grisu2),
+// NaN and infinities are written as null
+void appendDouble(std::string &output, double value);
+
 const std::string String(const Json::Value &value);
 const long long Int(const Json::Value &value);
 const double Double(const Json::Value &value);
@@ -188,4 +351,3 @@ const Json::Value& Array(const Json::Value &value);
 } // namespace ThreadServer
 
 #endif // JSON_H
-
@@ -0,0 +1,307 @@
+
+#ifndef THREADSERVER_HANDLER_CPP_HTTP_JSONBIND_H
+#define THREADSERVER_HANDLER_CPP_HTTP_JSONBIND_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include <threadserver/error.h>
+
+#include "json.h"
+#include "jsonparser.h"
+
+namespace ThreadServer {
+namespace JSON {
+
+// field list of a C++ struct, specialized at global scope by
+//
+//     JSON_BIND_BEGIN(Item_t)
+//         JSON_BIND_FIELD(name)
+//         JSON_BIND_NAMED_FIELD(className, "class")
+//     JSON_BIND_END()
+//
+// the keys are string literals with the quotes and separators already in
+// place, bound structs are serialized straight into the output
+template<class T>
+class Binding_t;
+
+// serializes and parses one type; strings, numbers, bools, std::vector and
+// boost::optional are built in, other types need a Binding_t
+template<class T>
+class Codec_t {
+public:
+    static void serialize(const T &value, std::string &output);
+
+    // throws Error_t when node doesn't match
+    static void parse(const Node_t &node, T &value);
+};
+
+template<class T>
+void serialize(const T &value, std::string &output)
+{
+    Codec_t<T>::serialize(value, output);
+}
+
+// missing members are parsed as null, i.e. they are errors unless the field
+// is a boost::optional
+template<class T>
+void parse(const Node_t &node, T &value)
+{
+    Codec_t<T>::parse(node, value);
+}
+
+class StructWriter_t {
+public:
+    StructWriter_t(std::string &output)
+      : output(output),
+        first(true)
+    {
+    }
+
+    // key is ,"name": and the comma is left out for the first member
+    template<class Field_t>
+    void operator()(const Field_t &value, const char *name,
+                    const char *key, size_t keySize)
+    {
+        if (first) {
+            output.append(key + 1, keySize - 1);
+            first = false;
+        } else {
+            output.append(key, keySize);
+        }
+        Codec_t<Field_t>::serialize(value, output);
+    }
+
+private:
+    std::string &output;
+    bool first;
+};
+
+class StructReader_t {
+public:
+    StructReader_t(const Node_t &node)
+      : node(node)
+    {
+    }
+
+    template<class Field_t>
+    void operator()(Field_t &value, const char *name,
+                    const char *key, size_t keySize)
+    {
+        try {
+            Codec_t<Field_t>::parse(node[name], value);
+        } catch (const Error_t &e) {
+            throw Error_t("Invalid member %s: %s", name, e.what());
+        }
+    }
+
+private:
+    const Node_t &node;
+};
+
+template<class T>
+void Codec_t<T>::serialize(const T &value, std::string &output)
+{
+    StructWriter_t writer(output);
+    output.push_back('{');
+    Binding_t<T>::fields(writer, value);
+    output.push_back('}');
+}
+
+template<class T>
+void Codec_t<T>::parse(const Node_t &node, T &value)
+{
+    StructReader_t reader(Struct(node));
+    Binding_t<T>::fields(reader, value);
+}
+
+template<>
+class Codec_t<std::string> {
+public:
+    static void serialize(const std::string &value, std::string &output)
+    {
+        String_t::escape(value.data(), value.size(), output);
+    }
+
+    static void parse(const Node_t &node, std::string &value)
+    {
+        value = String(node);
+    }
+};
+
+template<>
+class Codec_t<bool> {
+public:
+    static void serialize(const bool &value, std::string &output)
+    {
+        if (value) {
+            output.append("true", 4);
+        } else {
+            output.append("false", 5);
+        }
+    }
+
+    static void parse(const Node_t &node, bool &value)
+    {
+        value = Bool(node);
+    }
+};
+
+#define JSON_BIND_INTEGER(type) \
+    template<> \
+    class Codec_t<type> { \
+    public: \
+        static void serialize(const type &value, std::string &output) \
+        { \
+            appendInt(output, value); \
+        } \
+    \
+        static void parse(const Node_t &node, type &value) \
+        { \
+            long long parsed(Int(node)); \
+            value = static_cast<type>(parsed); \
+            if (static_cast<long long>(value) != parsed) { \
+                throw Error_t("Integer %lld out of range", parsed); \
+            } \
+        } \
+    };
+
+// the parser reads numbers above LLONG_MAX as doubles, so they don't parse
+#define JSON_BIND_UNSIGNED(type) \
+    template<> \
+    class Codec_t<type> { \
+    public: \
+        static void serialize(const type &value, std::string &output) \
+        { \
+            appendUnsigned(output, value); \
+        } \
+    \
+        static void parse(const Node_t &node, type &value) \
+        { \
+            long long parsed(Int(node)); \
+            value = static_cast<type>(parsed); \
+            if (parsed < 0 || static_cast<unsigned long long>(value) \
+                              != static_cast<unsigned long long>(parsed)) { \
+                throw Error_t("Integer %lld out of range", parsed); \
+            } \
+        } \
+    };
+
+JSON_BIND_INTEGER(short)
+JSON_BIND_INTEGER(int)
+JSON_BIND_INTEGER(long)
+JSON_BIND_INTEGER(long long)
+JSON_BIND_UNSIGNED(unsigned short)
+JSON_BIND_UNSIGNED(unsigned int)
+JSON_BIND_UNSIGNED(unsigned long)
+JSON_BIND_UNSIGNED(unsigned long long)
+
+#undef JSON_BIND_INTEGER
+#undef JSON_BIND_UNSIGNED
+
+#define JSON_BIND_FLOAT(type) \
+    template<> \
+    class Codec_t<type> { \
+    public: \
+        static void serialize(const type &value, std::string &output) \
+        { \
+            appendDouble(output, value); \
+        } \
+    \
+        static void parse(const Node_t &node, type &value) \
+        { \
+            value = static_cast<type>(Double(node)); \
+        } \
+    };
+
+JSON_BIND_FLOAT(float)
+JSON_BIND_FLOAT(double)
+
+#undef JSON_BIND_FLOAT
+
+template<class T>
+class Codec_t<std::vector<T> > {
+public:
+    static void serialize(const std::vector<T> &value, std::string &output)
+    {
+        output.push_back('[');
+        for (typename std::vector<T>::const_iterator ivalue(value.begin()) ;
+             ivalue != value.end() ; ++ivalue) {
+            if (ivalue != value.begin()) {
+                output.push_back(',');
+            }
+            Codec_t<T>::serialize(*ivalue, output);
+        }
+        output.push_back(']');
+    }
+
+    static void parse(const Node_t &node, std::vector<T> &value)
+    {
+        const Node_t &array(Array(node));
+        value.clear();
+        value.reserve(array.size());
+        for (Node_t::const_iterator ivalue(array.begin()) ; ivalue != array.end() ; ++ivalue) {
+            value.push_back(T());
+            try {
+                Codec_t<T>::parse(*ivalue, value.back());
+            } catch (const Error_t &e) {
+                throw Error_t("Invalid element %lu: %s",
+                              static_cast<unsigned long>(value.size() - 1), e.what());
+            }
+        }
+    }
+};
+
+// written as null when empty, null and missing members parse as empty
+template<class T>
+class Codec_t<boost::optional<T> > {
+public:
+    static void serialize(const boost::optional<T> &value, std::string &output)
+    {
+        if (value) {
+            Codec_t<T>::serialize(*value, output);
+        } else {
+            output.append("null", 4);
+        }
+    }
+
+    static void parse(const Node_t &node, boost::optional<T> &value)
+    {
+        if (node.isNull()) {
+            value = boost::none;
+            return;
+        }
+        value = T();
+        Codec_t<T>::parse(node, *value);
+    }
+};
+
+} // namespace JSON
+} // namespace ThreadServer
+
+#define JSON_BIND_BEGIN(type) \
+    namespace ThreadServer { \
+    namespace JSON { \
+    template<> \
+    class Binding_t<type> { \
+    public: \
+        template<class Visitor_t, class Object_t> \
+        static void fields(Visitor_t &visitor, Object_t &object) \
+        {
+
+// name has to be a string literal that needs no escaping
+#define JSON_BIND_NAMED_FIELD(field, name) \
+            visitor(object.field, name, ",\"" name "\":", sizeof(",\"" name "\":") - 1);
+
+#define JSON_BIND_FIELD(field) \
+            JSON_BIND_NAMED_FIELD(field, #field)
+
+#define JSON_BIND_END() \
+        } \
+    }; \
+    } \
+    }
+
+#endif // THREADSERVER_HANDLER_CPP_HTTP_JSONBIND_H
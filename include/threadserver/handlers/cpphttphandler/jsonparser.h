@@ -0,0 +1,150 @@
+
+#ifndef THREADSERVER_HANDLER_CPP_HTTP_JSONPARSER_H
+#define THREADSERVER_HANDLER_CPP_HTTP_JSONPARSER_H
+
+#include <stddef.h>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "json.h"
+
+namespace ThreadServer {
+namespace JSON {
+
+// one parsed value; containers are followed by their members (name, value
+// pairs for structs) and next is the index just past the whole subtree
+struct Element_t {
+    Type type;
+    size_t size;
+    size_t next;
+    union {
+        const char *string;
+        long long integer;
+        double real;
+        bool boolean;
+    } value;
+};
+
+// read-only view of a value in a Document_t, valid while the document lives;
+// missing members and out of range elements are null nodes
+class Node_t {
+public:
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Node_t value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const Node_t* pointer;
+        typedef Node_t reference;
+
+        const_iterator();
+
+        // element of an array or value of a struct member
+        Node_t operator*() const;
+
+        // name of a struct member
+        Node_t name() const;
+
+        const_iterator& operator++();
+
+        bool operator==(const const_iterator &other) const;
+
+        bool operator!=(const const_iterator &other) const;
+
+    private:
+        friend class Node_t;
+
+        const_iterator(const Element_t *element, bool members);
+
+        const Element_t *element;
+        bool members;
+    };
+
+    Node_t();
+
+    Type getType() const;
+
+    bool isNull() const;
+
+    // strings keep embedded NULs, data() is NUL terminated
+    const char* data() const;
+
+    // string length or number of members/elements
+    size_t size() const;
+
+    std::string asString() const;
+
+    long long asInt() const;
+
+    // integers are converted
+    double asDouble() const;
+
+    bool asBool() const;
+
+    // int rather than size_t so that node[0] is not ambiguous
+    Node_t operator[](int index) const;
+
+    Node_t operator[](const std::string &name) const;
+
+    Node_t operator[](const char *name) const;
+
+    bool has(const std::string &name) const;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    // deep copy into pool, e.g. to echo a part of the request
+    Value_t& copy(Pool_t &pool) const;
+
+    // like copy but strings reference the document, which must outlive the
+    // serialization of the pool's values
+    Value_t& borrow(Pool_t &pool) const;
+
+private:
+    friend class Document_t;
+
+    explicit Node_t(const Element_t *element);
+
+    const Element_t* find(const char *name, size_t size) const;
+
+    Value_t& convert(Pool_t &pool, bool borrowed) const;
+
+    const Element_t *element;
+};
+
+// parses into a copy of the input, strings are unescaped in place and all
+// values are kept in one flat vector
+class Document_t {
+public:
+    Document_t();
+
+    // throws Error_t on invalid input
+    void parse(const char *data, size_t size);
+
+    void parse(const std::string &data);
+
+    Node_t root() const;
+
+private:
+    class Parser_t;
+
+    Document_t(const Document_t&);
+    Document_t& operator=(const Document_t&);
+
+    std::vector<char> buffer;
+    std::vector<Element_t> elements;
+};
+
+const std::string String(const Node_t &node);
+const long long Int(const Node_t &node);
+const double Double(const Node_t &node);
+const bool Bool(const Node_t &node);
+const Node_t& Struct(const Node_t &node);
+const Node_t& Array(const Node_t &node);
+
+} // namespace JSON
+} // namespace ThreadServer
+
+#endif // THREADSERVER_HANDLER_CPP_HTTP_JSONPARSER_H
@@ -5,6 +5,7 @@
 #include <fstream>
 
 #include <threadserver/threadserver.h>
+#include <threadserver/batch.h>
 #include <threadserver/error.h>
 #include <threadserver/handlers/cppfrpchandler/cppfrpchandler.h>
 
@@ -34,7 +35,9 @@ CppFrpcHandler_t::CppFrpcHandler_t(ThreadServer_t *threadServer,
     frpcConfig(0),
     frpc(0),
     work(0),
-    helpDirectory(threadServer->configuration.get<std::string>(name + ".HelpDirectory", ""))
+    helpDirectory(threadServer->configuration.get<std::string>(name + ".HelpDirectory", "")),
+    multicallWorkers(),
+    multicallQueue()
 {
     std::string module(threadServer->configuration.get<std::string>(name + ".Module"));
     size_t pos(module.find(":"));
@@ -46,12 +49,229 @@ CppFrpcHandler_t::CppFrpcHandler_t(ThreadServer_t *threadServer,
 
     loadModule(filename, symbol);
 
+    for (size_t i(threadServer->configuration.get<size_t>(name + ".MulticallWorkers", 0)) ; i ; --i) {
+        multicallWorkers.push_back(new boost::thread(
+            boost::bind(&CppFrpcHandler_t::runMulticallWorker, this)));
+    }
+
     LOG(INFO4, "CppFrpcHandler module=%s", module.c_str());
 }
 
 CppFrpcHandler_t::~CppFrpcHandler_t()
 {
     destroyWorkers();
+
+    multicallQueue.finish();
+    for (std::vector<boost::thread*>::iterator imulticallWorkers(multicallWorkers.begin()) ;
+         imulticallWorkers != multicallWorkers.end() ;
+         ++imulticallWorkers) {
+
+        (*imulticallWorkers)->join();
+        delete *imulticallWorkers;
+    }
+}
+
+namespace {
+
+// fault code of malformed system.multicall entries
+const int MULTICALL_FAULT(-500);
+
+} // namespace
+
+// the calls of one system.multicall, run by the multicall workers and the
+// calling worker; results stay in the pool of their call until the caller
+// copies them
+class CppFrpcHandler_t::MulticallBatch_t : public ParallelBatch_t {
+public:
+    class Call_t {
+    public:
+        Call_t()
+          : methodName(),
+            params(0),
+            pool(),
+            result(0),
+            faultCode(0),
+            faultString()
+        {
+        }
+
+        std::string methodName;
+        // 0 when the entry is malformed
+        FRPC::Array_t *params;
+        FRPC::Pool_t pool;
+        FRPC::Value_t *result;
+        int faultCode;
+        std::string faultString;
+    };
+
+    typedef std::vector<boost::shared_ptr<Call_t> > Calls_t;
+
+    MulticallBatch_t(CppFrpcHandler_t &handler, const std::string &clientIP,
+                     SocketWork_t *work, const FRPC::HTTPHeader_t &headersIn,
+                     const Calls_t &calls)
+      : ParallelBatch_t(calls.size()),
+        clientIP(clientIP),
+        work(work),
+        headersIn(headersIn),
+        calls(calls),
+        handler(handler)
+    {
+    }
+
+    const std::string clientIP;
+    SocketWork_t *work;
+    const FRPC::HTTPHeader_t headersIn;
+    const Calls_t calls;
+
+private:
+    // runs in the registry of the current thread
+    virtual void runPart(size_t index)
+    {
+        Call_t &call(*calls[index]);
+        if (!call.params) {
+            return;
+        }
+        try {
+            call.result = &handler.frpc->registry().processCall(
+                clientIP, call.methodName, *call.params, call.pool);
+        } catch (const FRPC::Fault_t &fault) {
+            call.faultCode = fault.errorNum();
+            call.faultString = fault.message();
+        } catch (const std::exception &e) {
+            call.faultCode = MULTICALL_FAULT;
+            call.faultString = e.what();
+        } catch (...) {
+            call.faultCode = MULTICALL_FAULT;
+            call.faultString = "Unknown exception";
+        }
+    }
+
+    CppFrpcHandler_t &handler;
+};
+
+// replaces the sequential system.multicall of libfastrpc when there are
+// MulticallWorkers, results keep the order of the calls
+class CppFrpcHandler_t::Multicall_t : public FRPC::Method_t {
+public:
+    Multicall_t(CppFrpcHandler_t &handler)
+      : Method_t(),
+        called(false),
+        handler(handler)
+    {
+    }
+
+    virtual ~Multicall_t()
+    {
+    }
+
+    virtual FRPC::Value_t& call(FRPC::Pool_t &pool, FRPC::Array_t &params)
+    {
+        called = true;
+        if (params.size() != 1) {
+            throw FRPC::Fault_t(MULTICALL_FAULT, "system.multicall expects one array of calls");
+        }
+        FRPC::Array_t &entries(FRPC::Array(params[0]));
+
+        MulticallBatch_t::Calls_t calls;
+        for (FRPC::Array_t::iterator ientries(entries.begin()) ;
+             ientries != entries.end() ;
+             ++ientries) {
+
+            boost::shared_ptr<MulticallBatch_t::Call_t> call(new MulticallBatch_t::Call_t());
+            calls.push_back(call);
+            try {
+                FRPC::Struct_t &entry(FRPC::Struct(**ientries));
+                call->methodName = FRPC::String(entry["methodName"]).getString();
+                if (call->methodName == "system.multicall") {
+                    call->faultCode = MULTICALL_FAULT;
+                    call->faultString = "Recursive system.multicall forbidden";
+                } else {
+                    call->params = &FRPC::Array(entry["params"]);
+                }
+            } catch (const std::exception &e) {
+                call->faultCode = MULTICALL_FAULT;
+                call->faultString = e.what();
+            }
+        }
+
+        SocketWork_t *work(handler.getWork());
+        boost::shared_ptr<MulticallBatch_t> batch(new MulticallBatch_t(
+            handler, work ? work->getClientAddress() : std::string(), work,
+            handler.module->headersIn(), calls));
+        for (size_t i(batch->helpers(handler.multicallWorkers.size())) ; i ; --i) {
+            handler.multicallQueue.enqueue(batch);
+        }
+        batch->run();
+        batch->wait();
+
+        FRPC::Array_t &results(pool.Array());
+        for (size_t i(0) ; i < calls.size() ; ++i) {
+            const MulticallBatch_t::Call_t &call(*calls[i]);
+            if (call.result) {
+                results.append(pool.Array(call.result->clone(pool)));
+            } else {
+                results.append(pool.Struct(
+                    "faultCode", pool.Int(call.faultCode),
+                    "faultString", pool.String(call.faultString)));
+            }
+        }
+        return results;
+    }
+
+    // tells whether the registry dispatches system.multicall here
+    bool called;
+
+private:
+    CppFrpcHandler_t &handler;
+};
+
+// multicall workers get the same thread specific FRPC server and module
+// state as workers, and the socket and headers of the multicall they run
+void CppFrpcHandler_t::runMulticallWorker()
+{
+    threadCreate();
+
+    for (;;) {
+        boost::optional<boost::shared_ptr<MulticallBatch_t> > batch(multicallQueue.dequeue());
+        if (!batch) {
+            break;
+        }
+        module->_headersIn.reset(new FRPC::HTTPHeader_t((*batch)->headersIn));
+        module->_headersOut.reset(new FRPC::HTTPHeader_t());
+        work.reset((*batch)->work);
+        (*batch)->run();
+        work.release();
+        module->_headersIn.reset();
+        module->_headersOut.reset();
+    }
+
+    threadDestroy();
+}
+
+void CppFrpcHandler_t::threadCreate()
+{
+    callbacks.reset(new Callbacks_t());
+
+    frpcConfig.reset(new FRPC::Server_t::Config_t(
+        readTimeout,
+        writeTimeout,
+        keepAlive,
+        maxKeepAlive,
+        introspectionEnabled,
+        callbacks.get()));
+
+    frpc.reset(new FRPC::Server_t(*frpcConfig));
+
+    module->threadCreate();
+}
+
+void CppFrpcHandler_t::threadDestroy()
+{
+    module->threadDestroy();
+
+    delete frpc.release();
+    delete frpcConfig.release();
+    delete callbacks.release();
 }
 
 Handler_t::Worker_t* CppFrpcHandler_t::createWorker(Handler_t *handler)
@@ -63,28 +283,32 @@ CppFrpcHandler_t::Worker_t::Worker_t(CppFrpcHandler_t *handler)
   : Handler_t::Worker_t(handler),
     handler(handler)
 {
-    handler->callbacks.reset(new Callbacks_t());
+    handler->threadCreate();
 
-    handler->frpcConfig.reset(new FRPC::Server_t::Config_t(
-        handler->readTimeout,
-        handler->writeTimeout,
-        handler->keepAlive,
-        handler->maxKeepAlive,
-        handler->introspectionEnabled,
-        handler->callbacks.get()));
+    if (!handler->multicallWorkers.empty()) {
+        Multicall_t *multicall(new Multicall_t(*handler));
+        handler->frpc->registry().registerMethod(
+            "system.multicall", multicall, "A:A",
+            "Runs the calls in parallel and returns their results in order");
 
-    handler->frpc.reset(new FRPC::Server_t(*handler->frpcConfig));
-
-    handler->module->threadCreate();
+        // the registry may keep its own system.multicall, an empty one
+        // shows which is called
+        FRPC::Pool_t pool;
+        try {
+            handler->frpc->registry().processCall(
+                std::string(), "system.multicall", pool.Array(pool.Array()), pool);
+        } catch (...) {
+        }
+        if (!multicall->called) {
+            LOG(WARN2, "Can't replace system.multicall of libfastrpc, "
+                "multicalls run sequentially");
+        }
+    }
 }
 
 CppFrpcHandler_t::Worker_t::~Worker_t()
 {
-    handler->module->threadDestroy();
-
-    delete handler->frpc.release();
-    delete handler->frpcConfig.release();
-    delete handler->callbacks.release();
+    handler->threadDestroy();
 }
 
 void CppFrpcHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
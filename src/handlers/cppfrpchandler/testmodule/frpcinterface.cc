@@ -1,4 +1,6 @@
 
+#include <sstream>
+#include <boost/thread.hpp>
 #include "frpcinterface.h"
 
 #define REGMET(name, method, signature) \
@@ -10,6 +12,7 @@ FrpcInterface_t::FrpcInterface_t(ThreadServer::CppFrpcHandler_t *handler,
     core(core)
 {
     REGMET("test", testMethod, "S:");
+    REGMET("test.thread", threadMethod, "S:i");
 }
 
 #undef REGMET
@@ -26,4 +29,18 @@ METHOD(testMethod)
         "clientAddress", pool.String(handler->getWork()->getClientAddress()));
 }
 
+// sleeps the given milliseconds, a system.multicall of several calls ends
+// after about one sleep and reports different threads when MulticallWorkers
+// run them in parallel
+METHOD(threadMethod)
+{
+    boost::this_thread::sleep(boost::posix_time::milliseconds(FRPC::Int(params[0]).getValue()));
+    std::ostringstream thread;
+    thread << boost::this_thread::get_id();
+    return pool.Struct(
+        "status", pool.Int(200),
+        "statusMessage", pool.String("OK"),
+        "thread", pool.String(thread.str()));
+}
+
 #undef METHOD
@@ -14,6 +14,8 @@ public:
 
     METHOD(testMethod);
 
+    METHOD(threadMethod);
+
 private:
     ThreadServer::CppFrpcHandler_t *handler;
     Core_t &core;
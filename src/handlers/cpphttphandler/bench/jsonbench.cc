@@ -0,0 +1,281 @@
+
+// compares the JSON serializer with the one it replaced, which built every
+// subtree into its own std::stringstream; prints microseconds per tree
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+#include <threadserver/handlers/cpphttphandler/json.h>
+
+namespace {
+
+// the replaced serializer, strings only get the escapes the trees need
+namespace Old {
+
+class Value_t {
+public:
+    virtual ~Value_t()
+    {
+    }
+
+    virtual operator std::string() const = 0;
+};
+
+class String_t : public Value_t {
+public:
+    String_t(const std::string &data)
+      : data(data)
+    {
+    }
+
+    virtual operator std::string() const
+    {
+        return escape(data);
+    }
+
+    static std::string escape(const std::string &s)
+    {
+        std::string result("\"");
+        for (size_t i(0) ; i < s.size() ; ++i) {
+            if (s[i] == '"' || s[i] == '\\') {
+                result.push_back('\\');
+            }
+            result.push_back(s[i]);
+        }
+        result.push_back('"');
+        return result;
+    }
+
+private:
+    const std::string data;
+};
+
+class Int_t : public Value_t {
+public:
+    Int_t(const long long data)
+      : data(data)
+    {
+    }
+
+    virtual operator std::string() const
+    {
+        return boost::lexical_cast<std::string>(data);
+    }
+
+private:
+    const long long data;
+};
+
+class Struct_t : public Value_t {
+public:
+    virtual operator std::string() const
+    {
+        std::stringstream output;
+        output << "{";
+        std::string comma;
+        for (std::map<std::string, const Value_t*>::const_iterator idata(data.begin()) ;
+             idata != data.end() ;
+             ++idata) {
+
+            output << comma << String_t::escape(idata->first) << ":" << std::string(*idata->second);
+            comma = ",";
+        }
+        output << "}";
+        return output.str();
+    }
+
+    Struct_t& append(const std::string &name, const Value_t &value)
+    {
+        data[name] = &value;
+        return *this;
+    }
+
+private:
+    std::map<std::string, const Value_t*> data;
+};
+
+class Array_t : public Value_t {
+public:
+    virtual operator std::string() const
+    {
+        std::stringstream output;
+        output << "[";
+        std::string comma;
+        for (std::vector<const Value_t*>::const_iterator idata(data.begin()) ;
+             idata != data.end() ;
+             ++idata) {
+
+            output << comma << std::string(**idata);
+            comma = ",";
+        }
+        output << "]";
+        return output.str();
+    }
+
+    Array_t& push_back(const Value_t &value)
+    {
+        data.push_back(&value);
+        return *this;
+    }
+
+private:
+    std::vector<const Value_t*> data;
+};
+
+class Pool_t {
+public:
+    ~Pool_t()
+    {
+        for (std::list<Value_t*>::iterator ivalues(values.begin()) ;
+             ivalues != values.end() ;
+             ++ivalues) {
+
+            delete *ivalues;
+        }
+    }
+
+    String_t& String(const std::string &data)
+    {
+        return add(new String_t(data));
+    }
+
+    Int_t& Int(const long long data)
+    {
+        return add(new Int_t(data));
+    }
+
+    Struct_t& Struct()
+    {
+        return add(new Struct_t());
+    }
+
+    Array_t& Array()
+    {
+        return add(new Array_t());
+    }
+
+private:
+    template<class T_t>
+    T_t& add(T_t *value)
+    {
+        values.push_back(value);
+        return *value;
+    }
+
+    std::list<Value_t*> values;
+};
+
+} // namespace Old
+
+// both serializers get the same tree; member names are appended in sorted
+// order, the old one keeps them in a std::map and its output can only be
+// compared byte for byte with the new one's because of that
+template<class Pool_t, class Value_t>
+const Value_t& item(Pool_t &pool, size_t index)
+{
+    return pool.Struct().append(
+        "id", pool.Int(index)).append(
+        "name", pool.String("item \"" + boost::lexical_cast<std::string>(index) + "\"")).append(
+        "price", pool.Int(index * 100 + 99)).append(
+        "tags", pool.Array().push_back(
+            pool.String("new")).push_back(
+            pool.String("sale")));
+}
+
+template<class Pool_t, class Value_t, class Array_t>
+const Value_t& wide(Pool_t &pool, size_t size)
+{
+    Array_t &items(pool.Array());
+    for (size_t i(0) ; i < size ; ++i) {
+        items.push_back(item<Pool_t, Value_t>(pool, i));
+    }
+    return pool.Struct().append("count", pool.Int(size)).append("items", items);
+}
+
+template<class Pool_t, class Value_t, class Array_t>
+const Value_t& deep(Pool_t &pool, size_t depth)
+{
+    const Value_t *value(&item<Pool_t, Value_t>(pool, depth));
+    for (size_t i(depth) ; i-- > 0 ; ) {
+        if (i % 2) {
+            value = &pool.Array().push_back(pool.Int(i)).push_back(*value);
+        } else {
+            value = &pool.Struct().append("child", *value).append("level", pool.Int(i));
+        }
+    }
+    return *value;
+}
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+typedef const Old::Value_t& (*OldTree_t)(Old::Pool_t &pool, size_t size);
+typedef const ThreadServer::JSON::Value_t& (*NewTree_t)(ThreadServer::JSON::Pool_t &pool,
+                                                        size_t size);
+
+// times serializing only, the trees are built once
+void bench(const char *name, OldTree_t oldTree, NewTree_t newTree, size_t size,
+           size_t iterations)
+{
+    Old::Pool_t oldPool;
+    const Old::Value_t &oldValue(oldTree(oldPool, size));
+    ThreadServer::JSON::Pool_t newPool;
+    const ThreadServer::JSON::Value_t &newValue(newTree(newPool, size));
+
+    std::string oldOutput(oldValue);
+    std::string newOutput;
+    newValue.serialize(newOutput);
+    if (oldOutput != newOutput) {
+        fprintf(stderr, "%s %lu: outputs differ\n", name, static_cast<unsigned long>(size));
+        exit(1);
+    }
+
+    double start(now());
+    for (size_t i(0) ; i < iterations ; ++i) {
+        std::string output(oldValue);
+    }
+    double oldTime((now() - start) / iterations);
+
+    start = now();
+    for (size_t i(0) ; i < iterations ; ++i) {
+        std::string output;
+        newValue.serialize(output);
+    }
+    double newTime((now() - start) / iterations);
+
+    printf("%-6s %7lu %9lu %12.1f %12.1f %8.1fx\n", name, static_cast<unsigned long>(size),
+           static_cast<unsigned long>(newOutput.size()), oldTime, newTime, oldTime / newTime);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t iterations(argc > 1 ? atoi(argv[1]) : 20);
+
+    printf("%-6s %7s %9s %12s %12s %9s\n", "tree", "size", "bytes", "old us", "new us", "speedup");
+    bench("wide", &wide<Old::Pool_t, Old::Value_t, Old::Array_t>,
+          &wide<ThreadServer::JSON::Pool_t, ThreadServer::JSON::Value_t,
+               ThreadServer::JSON::Array_t>, 100, iterations * 100);
+    bench("wide", &wide<Old::Pool_t, Old::Value_t, Old::Array_t>,
+          &wide<ThreadServer::JSON::Pool_t, ThreadServer::JSON::Value_t,
+               ThreadServer::JSON::Array_t>, 10000, iterations);
+    bench("deep", &deep<Old::Pool_t, Old::Value_t, Old::Array_t>,
+          &deep<ThreadServer::JSON::Pool_t, ThreadServer::JSON::Value_t,
+               ThreadServer::JSON::Array_t>, 100, iterations * 10);
+    bench("deep", &deep<Old::Pool_t, Old::Value_t, Old::Array_t>,
+          &deep<ThreadServer::JSON::Pool_t, ThreadServer::JSON::Value_t,
+               ThreadServer::JSON::Array_t>, 2000, iterations);
+    return 0;
+}
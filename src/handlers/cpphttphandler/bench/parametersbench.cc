@@ -0,0 +1,198 @@
+
+// compares CppHttpHandler_t::Parameters_t with the tokenizer based parser it
+// replaced on long query strings, large form bodies and malformed escapes;
+// prints microseconds to parse a string and read every parameter once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/tokenizer.hpp>
+
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+
+namespace {
+
+// the replaced parser
+namespace Old {
+
+class Parameters_t {
+public:
+    void parse(const std::string &params)
+    {
+        boost::char_separator<char> sep("&");
+        boost::tokenizer<boost::char_separator<char> > tokens(params, sep);
+        BOOST_FOREACH(std::string t, tokens) {
+            size_t pos(t.find("="));
+            if (pos == std::string::npos) {
+                data[unescape(t)].push_back("");
+            } else {
+                data[unescape(t.substr(0, pos))].push_back(unescape(t.substr(pos+1)));
+            }
+        }
+    }
+
+    bool getFirst(const std::string &name, std::string &value) const
+    {
+        std::map<std::string, std::list<std::string> >::const_iterator idata(data.find(name));
+        if (idata == data.end()) {
+            return false;
+        }
+        value = idata->second.front();
+        return true;
+    }
+
+private:
+    int unhex(const char c)
+    {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 0xa;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 0xa;
+        }
+        throw std::runtime_error("invalid hex digit");
+    }
+
+    std::string unescape(const std::string &s)
+    {
+        std::string result;
+        for (size_t i(0) ; i < s.size() ; ++i) {
+            if (s[i] == '+') {
+                result.push_back(' ');
+            } else if (s[i] == '%' && i < s.size() - 2) {
+                int d1, d2;
+                try {
+                    d1 = unhex(s[i+1]);
+                    d2 = unhex(s[i+2]);
+                    result.push_back(char(d1*16+d2));
+                    i += 2;
+                } catch (const std::exception &e) {
+                    result.push_back(s[i]);
+                }
+            } else {
+                result.push_back(s[i]);
+            }
+        }
+        return result;
+    }
+
+    std::map<std::string, std::list<std::string> > data;
+};
+
+} // namespace Old
+
+// count parameters, escaped values of about valueSize bytes; bad adds an
+// invalid escape to every value
+std::string form(size_t count, size_t valueSize, bool escaped, bool bad,
+                 std::vector<std::string> &names)
+{
+    std::string result;
+    names.clear();
+    for (size_t i(0) ; i < count ; ++i) {
+        std::string name("field" + boost::lexical_cast<std::string>(i));
+        names.push_back(name);
+        if (i) {
+            result.push_back('&');
+        }
+        result.append(name);
+        result.push_back('=');
+        while (result.size() - result.rfind('=') <= valueSize) {
+            result.append(escaped ? "caf%C3%A9+%26+bar%2Fbaz+" : "plainvalue");
+            if (bad) {
+                result.append("%zz");
+            }
+        }
+    }
+    return result;
+}
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+void bench(const char *name, const std::string &data, const std::vector<std::string> &names,
+           size_t iterations)
+{
+    {
+        Old::Parameters_t oldParameters;
+        oldParameters.parse(data);
+        ThreadServer::CppHttpHandler_t::Parameters_t newParameters;
+        newParameters.parse(data.data(), data.size());
+        for (std::vector<std::string>::const_iterator inames(names.begin()) ;
+             inames != names.end() ;
+             ++inames) {
+
+            std::string oldValue;
+            std::string newValue;
+            if (!oldParameters.getFirst(*inames, oldValue)
+                || !newParameters.getFirst(*inames, newValue) || oldValue != newValue) {
+                fprintf(stderr, "%s: values of %s differ\n", name, inames->c_str());
+                exit(1);
+            }
+        }
+    }
+
+    std::string value;
+    double start(now());
+    for (size_t i(0) ; i < iterations ; ++i) {
+        Old::Parameters_t parameters;
+        parameters.parse(data);
+        for (std::vector<std::string>::const_iterator inames(names.begin()) ;
+             inames != names.end() ;
+             ++inames) {
+
+            parameters.getFirst(*inames, value);
+        }
+    }
+    double oldTime((now() - start) / iterations);
+
+    start = now();
+    for (size_t i(0) ; i < iterations ; ++i) {
+        ThreadServer::CppHttpHandler_t::Parameters_t parameters;
+        parameters.parse(data.data(), data.size());
+        for (std::vector<std::string>::const_iterator inames(names.begin()) ;
+             inames != names.end() ;
+             ++inames) {
+
+            parameters.getFirst(*inames, value);
+        }
+    }
+    double newTime((now() - start) / iterations);
+
+    printf("%-10s %9lu %6lu %12.1f %12.1f %8.1fx\n", name,
+           static_cast<unsigned long>(data.size()), static_cast<unsigned long>(names.size()),
+           oldTime, newTime, oldTime / newTime);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t iterations(argc > 1 ? atoi(argv[1]) : 20);
+    std::vector<std::string> names;
+
+    printf("%-10s %9s %6s %12s %12s %9s\n", "input", "bytes", "params", "old us", "new us",
+           "speedup");
+    std::string query(form(100, 40, true, false, names));
+    bench("query", query, names, iterations * 100);
+    std::string plain(form(1000, 1000, false, false, names));
+    bench("form", plain, names, iterations);
+    std::string escaped(form(1000, 1000, true, false, names));
+    bench("escaped", escaped, names, iterations);
+    std::string malformed(form(1000, 1000, true, true, names));
+    bench("malformed", malformed, names, iterations);
+    return 0;
+}
@@ -0,0 +1,306 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+#include <threadserver/handlers/cpphttphandler/hash.h>
+
+namespace ThreadServer {
+
+namespace {
+
+typedef std::vector<std::pair<const char*, size_t> > Pieces_t;
+
+void bodyPieces(const CppHttpHandler_t::Response_t &response, Pieces_t &pieces)
+{
+    pieces.clear();
+    if (!response.data.empty()) {
+        pieces.push_back(std::make_pair(response.data.data(), response.data.size()));
+    }
+    for (CppHttpHandler_t::Response_t::Chain_t::const_iterator ichain(response.chain.begin()) ;
+         ichain != response.chain.end() ;
+         ++ichain) {
+
+        if (ichain->size) {
+            pieces.push_back(std::make_pair(ichain->data, ichain->size));
+        }
+    }
+}
+
+bool samePieces(const Pieces_t &pieces, const std::string &data)
+{
+    size_t offset(0);
+    for (Pieces_t::const_iterator ipieces(pieces.begin()) ;
+         ipieces != pieces.end() ;
+         ++ipieces) {
+
+        if (offset + ipieces->second > data.size()
+            || memcmp(data.data() + offset, ipieces->first, ipieces->second)) {
+            return false;
+        }
+        offset += ipieces->second;
+    }
+    return offset == data.size();
+}
+
+// true if the Accept-Encoding header lists gzip with non-zero quality
+bool acceptsGzip(const std::string &acceptEncoding)
+{
+    size_t begin(0);
+    while (begin < acceptEncoding.size()) {
+        size_t end(acceptEncoding.find(',', begin));
+        if (end == std::string::npos) {
+            end = acceptEncoding.size();
+        }
+        std::string coding(acceptEncoding, begin, end - begin);
+        begin = end + 1;
+
+        std::string quality;
+        size_t semicolon(coding.find(';'));
+        if (semicolon != std::string::npos) {
+            quality = coding.substr(semicolon + 1);
+            coding.erase(semicolon);
+        }
+        size_t first(coding.find_first_not_of(" \t"));
+        size_t last(coding.find_last_not_of(" \t"));
+        if (first == std::string::npos) {
+            continue;
+        }
+        coding = coding.substr(first, last - first + 1);
+        if (strcasecmp(coding.c_str(), "gzip") && strcasecmp(coding.c_str(), "x-gzip")
+            && coding != "*") {
+            continue;
+        }
+
+        size_t q(quality.find("q="));
+        if (q != std::string::npos && strtod(quality.c_str() + q + 2, 0) <= 0.0) {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+class CppHttpHandler_t::Compressor_t::Deflater_t {
+public:
+    Deflater_t(int level)
+      : buffer()
+    {
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw Error_t("Can't initialize gzip compression: %s",
+                stream.msg ? stream.msg : "unknown error");
+        }
+    }
+
+    ~Deflater_t()
+    {
+        deflateEnd(&stream);
+    }
+
+    const std::string& deflate(const Pieces_t &pieces, size_t size)
+    {
+        deflateReset(&stream);
+        buffer.resize(deflateBound(&stream, size));
+        stream.next_out = reinterpret_cast<Bytef*>(&buffer[0]);
+        stream.avail_out = buffer.size();
+
+        for (size_t i(0) ; i < pieces.size() ; ++i) {
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pieces[i].first));
+            stream.avail_in = pieces[i].second;
+            int flush((i + 1 == pieces.size()) ? Z_FINISH : Z_NO_FLUSH);
+            for (;;) {
+                if (!stream.avail_out) {
+                    size_t used(buffer.size());
+                    buffer.resize(used * 2);
+                    stream.next_out = reinterpret_cast<Bytef*>(&buffer[used]);
+                    stream.avail_out = buffer.size() - used;
+                }
+                int result(::deflate(&stream, flush));
+                if (result == Z_STREAM_END) {
+                    break;
+                }
+                if (result != Z_OK && result != Z_BUF_ERROR) {
+                    throw Error_t("Can't compress response: %s",
+                        stream.msg ? stream.msg : "unknown error");
+                }
+                if (!stream.avail_in && flush != Z_FINISH && stream.avail_out) {
+                    break;
+                }
+            }
+        }
+        buffer.resize(stream.total_out);
+        return buffer;
+    }
+
+private:
+    z_stream stream;
+    std::string buffer;
+};
+
+CppHttpHandler_t::Compressor_t::Entry_t::Entry_t()
+  : original(),
+    compressed(),
+    lru()
+{
+}
+
+CppHttpHandler_t::Compressor_t::Compressor_t(const std::vector<std::string> &contentTypes,
+                                             const size_t minSize,
+                                             const int level,
+                                             const size_t cacheSize)
+  : contentTypes(contentTypes),
+    minSize(minSize),
+    level(level),
+    cacheSize(cacheSize),
+    deflaters(),
+    mutex(),
+    cache(),
+    lru(),
+    cacheUsed(0)
+{
+}
+
+CppHttpHandler_t::Compressor_t::~Compressor_t()
+{
+}
+
+bool CppHttpHandler_t::Compressor_t::compressible(const Response_t &response) const
+{
+    if (response.status < 200 || response.status >= 300
+        || response.status == 204 || response.status == 206) {
+        return false;
+    }
+    if (response.file.size || response.streaming()) {
+        return false;
+    }
+
+    std::string value;
+    response.headers.get("Content-Encoding", value);
+    if (!value.empty()) {
+        return false;
+    }
+    response.headers.get("Content-Length", value);
+    if (!value.empty()) {
+        return false;
+    }
+
+    if (response.bodySize() < minSize) {
+        return false;
+    }
+
+    size_t semicolon(response.contentType.find(';'));
+    std::string contentType(response.contentType.substr(0, semicolon));
+    for (std::vector<std::string>::const_iterator icontentTypes(contentTypes.begin()) ;
+         icontentTypes != contentTypes.end() ;
+         ++icontentTypes) {
+
+        if (!strcasecmp(contentType.c_str(), icontentTypes->c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CppHttpHandler_t::Compressor_t::compress(const Request_t &request, Response_t &response)
+{
+    if (request.method == "HEAD" || !compressible(response)) {
+        return;
+    }
+
+    std::string vary;
+    response.headers.get("Vary", vary);
+    response.headers.set("Vary", vary.empty() ? "Accept-Encoding" : vary + ", Accept-Encoding");
+
+    std::string acceptEncoding(request.headers[Headers_t::ACCEPT_ENCODING].str());
+    if (!acceptsGzip(acceptEncoding)) {
+        return;
+    }
+
+    Pieces_t pieces;
+    bodyPieces(response, pieces);
+    size_t size(response.bodySize());
+
+    uint64_t key(0);
+    if (response.cacheable && cacheSize) {
+        for (Pieces_t::const_iterator ipieces(pieces.begin()) ;
+             ipieces != pieces.end() ;
+             ++ipieces) {
+
+            key = hash64(ipieces->first, ipieces->second, key);
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        Cache_t::iterator icache(cache.find(key));
+        if (icache != cache.end() && samePieces(pieces, *icache->second.original)) {
+            lru.splice(lru.begin(), lru, icache->second.lru);
+            boost::shared_ptr<const std::string> compressed(icache->second.compressed);
+            lock.unlock();
+
+            response.data.clear();
+            response.chain.clear();
+            response.append(compressed);
+            response.headers.set("Content-Encoding", "gzip");
+            return;
+        }
+    }
+
+    if (!deflaters.get()) {
+        deflaters.reset(new Deflater_t(level));
+    }
+    const std::string &compressed(deflaters->deflate(pieces, size));
+    if (compressed.size() >= size) {
+        return;
+    }
+
+    if (response.cacheable && cacheSize && size + compressed.size() <= cacheSize) {
+        boost::shared_ptr<std::string> original(new std::string());
+        original->reserve(size);
+        for (Pieces_t::const_iterator ipieces(pieces.begin()) ;
+             ipieces != pieces.end() ;
+             ++ipieces) {
+
+            original->append(ipieces->first, ipieces->second);
+        }
+        boost::shared_ptr<const std::string> shared(new std::string(compressed));
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            Cache_t::iterator icache(cache.find(key));
+            if (icache != cache.end()) {
+                cacheUsed -= icache->second.original->size() + icache->second.compressed->size();
+                lru.erase(icache->second.lru);
+                cache.erase(icache);
+            }
+
+            Entry_t &entry(cache[key]);
+            entry.original = original;
+            entry.compressed = shared;
+            lru.push_front(key);
+            entry.lru = lru.begin();
+            cacheUsed += original->size() + shared->size();
+
+            while (cacheUsed > cacheSize && !lru.empty()) {
+                Cache_t::iterator ievict(cache.find(lru.back()));
+                cacheUsed -= ievict->second.original->size() + ievict->second.compressed->size();
+                cache.erase(ievict);
+                lru.pop_back();
+            }
+        }
+
+        response.data.clear();
+        response.chain.clear();
+        response.append(shared);
+    } else {
+        response.data.clear();
+        response.chain.clear();
+        response.append(compressed.data(), compressed.size());
+    }
+    response.headers.set("Content-Encoding", "gzip");
+}
+
+} // namespace ThreadServer
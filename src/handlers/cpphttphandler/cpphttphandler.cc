@@ -2,21 +2,23 @@
 #include <dbglog.h>
 #include <dlfcn.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
 #include <fstream>
+#include <limits>
 
 #include <frpchttpclient.h>
 #include <frpchttpio.h>
 #include <frpcunmarshaller.h>
 
-#include <boost/foreach.hpp>
-#include <boost/tokenizer.hpp>
-#include <boost/lambda/lambda.hpp>
-
 #include <threadserver/threadserver.h>
+#include <threadserver/batch.h>
 #include <threadserver/error.h>
 #include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
-
-#include <mimetic/mimetic.h>
+#include <threadserver/handlers/cpphttphandler/hash.h>
+#include <threadserver/handlers/cpphttphandler/httpdate.h>
 
 namespace ThreadServer {
 
@@ -24,14 +26,34 @@ CppHttpHandler_t::CppHttpHandler_t(ThreadServer_t *threadServer,
                                    const std::string &name,
                                    const size_t workerCount)
   : Handler_t(threadServer, name, workerCount),
+    fragments(),
     moduleHandle(0),
     module(0),
     work(0),
     readTimeout(threadServer->configuration.get<time_t>(name + ".ReadTimeout", 10000)),
     writeTimeout(threadServer->configuration.get<time_t>(name + ".WriteTimeout", 10000)),
     maxLineSize(threadServer->configuration.get<size_t>(name + ".MaxLineSize", 1024)),
-    maxRequestSize(threadServer->configuration.get<int>(name + ".MaxRequestSize", 1024*1024)),
-    methodRegistry(0)
+    maxRequestSize(threadServer->configuration.get<size_t>(name + ".MaxRequestSize", 1024*1024)),
+    maxStreamedBodySize(threadServer->configuration.get<size_t>(
+        name + ".MaxStreamedBodySize", 1024*1024*1024)),
+    maxHeaderLines(threadServer->configuration.get<size_t>(name + ".MaxHeaderLines", 100)),
+    streamChunkSize(threadServer->configuration.get<size_t>(name + ".StreamChunkSize", 16384)),
+    autoETag(threadServer->configuration.getBool(name + ".ETag", true)),
+    multipartSpoolSize(threadServer->configuration.get<size_t>(
+        name + ".MultipartSpoolSize", 1024*1024)),
+    multipartSpoolDirectory(threadServer->configuration.get<std::string>(
+        name + ".MultipartSpoolDirectory", "/tmp")),
+    compressor(0),
+    responseCacheSize(threadServer->configuration.get<size_t>(
+        name + ".ResponseCacheSize", 64*1024*1024)),
+    responseCacheShards(threadServer->configuration.get<size_t>(
+        name + ".ResponseCacheShards", 16)),
+    responseCacheMutex(),
+    responseCache(0),
+    methodRegistry(0),
+    responseWriter(0),
+    batchWorkers(),
+    batchQueue()
 {
     std::string module(threadServer->configuration.get<std::string>(name + ".Module"));
     size_t pos(module.find(":"));
@@ -41,14 +63,129 @@ CppHttpHandler_t::CppHttpHandler_t(ThreadServer_t *threadServer,
     std::string filename(module.substr(0, pos));
     std::string symbol(module.substr(pos + 1));
 
+    if (threadServer->configuration.getBool(name + ".Compression", false)) {
+        std::vector<std::string> contentTypes(
+            threadServer->configuration.getVector<std::string>(name + ".CompressionType"));
+        if (contentTypes.empty()) {
+            contentTypes.push_back("text/html");
+            contentTypes.push_back("text/plain");
+            contentTypes.push_back("text/css");
+            contentTypes.push_back("text/csv");
+            contentTypes.push_back("text/xml");
+            contentTypes.push_back("application/json");
+            contentTypes.push_back("application/javascript");
+        }
+        compressor.reset(new Compressor_t(
+            contentTypes,
+            threadServer->configuration.get<size_t>(name + ".CompressionMinSize", 1024),
+            threadServer->configuration.get<int>(name + ".CompressionLevel", 6),
+            threadServer->configuration.get<size_t>(name + ".CompressionCacheSize", 16*1024*1024)));
+    }
+
     loadModule(filename, symbol);
 
+    for (size_t i(threadServer->configuration.get<size_t>(name + ".BatchWorkers", 0)) ; i ; --i) {
+        batchWorkers.push_back(new boost::thread(
+            boost::bind(&CppHttpHandler_t::runBatchWorker, this)));
+    }
+
     LOG(INFO4, "CppHttpHandler module=%s", module.c_str());
 }
 
 CppHttpHandler_t::~CppHttpHandler_t()
 {
     destroyWorkers();
+
+    batchQueue.finish();
+    for (std::vector<boost::thread*>::iterator ibatchWorkers(batchWorkers.begin()) ;
+         ibatchWorkers != batchWorkers.end() ;
+         ++ibatchWorkers) {
+
+        (*ibatchWorkers)->join();
+        delete *ibatchWorkers;
+    }
+}
+
+class CppHttpHandler_t::Batch_t : public ParallelBatch_t {
+public:
+    Batch_t(ParallelTask_t &task, size_t count, SocketWork_t *work)
+      : ParallelBatch_t(count),
+        work(work),
+        task(task),
+        owner()
+    {
+    }
+
+    // a single part nobody waits for, the batch keeps the task alive
+    Batch_t(const boost::shared_ptr<ParallelTask_t> &owner)
+      : ParallelBatch_t(1),
+        work(0),
+        task(*owner),
+        owner(owner)
+    {
+    }
+
+    // connection of the calling worker, for getWork() on batch workers
+    SocketWork_t *work;
+
+private:
+    virtual void runPart(size_t index)
+    {
+        task.run(index);
+    }
+
+    ParallelTask_t &task;
+    boost::shared_ptr<ParallelTask_t> owner;
+};
+
+class CppHttpHandler_t::Refresh_t : public ParallelTask_t {
+public:
+    Refresh_t(CppHttpHandler_t &handler, const Request_t &request, const std::string &cacheKey)
+      : handler(handler),
+        request(request),
+        cacheKey(cacheKey)
+    {
+    }
+
+    virtual void run(size_t)
+    {
+        handler.refresh(request, cacheKey);
+    }
+
+private:
+    CppHttpHandler_t &handler;
+    Request_t request;
+    std::string cacheKey;
+};
+
+void CppHttpHandler_t::parallel(ParallelTask_t &task, size_t count)
+{
+    boost::shared_ptr<Batch_t> batch(new Batch_t(task, count, work.get()));
+    for (size_t i(batch->helpers(batchWorkers.size())) ; i ; --i) {
+        batchQueue.enqueue(batch);
+    }
+    batch->run();
+    batch->wait();
+}
+
+// batch workers get the same thread specific module state as workers
+void CppHttpHandler_t::runBatchWorker()
+{
+    methodRegistry.reset(new MethodRegistry_t());
+    module->threadCreate();
+
+    for (;;) {
+        boost::optional<boost::shared_ptr<Batch_t> > batch(batchQueue.dequeue());
+        if (!batch) {
+            break;
+        }
+        work.reset((*batch)->work);
+        (*batch)->run();
+        work.release();
+    }
+
+    module->threadDestroy();
+    delete methodRegistry.release();
 }
 
 Handler_t::Worker_t* CppHttpHandler_t::createWorker(Handler_t *handler)
@@ -60,8 +197,8 @@ CppHttpHandler_t::Worker_t::Worker_t(CppHttpHandler_t *handler)
   : Handler_t::Worker_t(handler),
     handler(handler)
 {
-    handler->methodRegistry.reset(
-        new std::list<std::pair<boost::regex, Method_t*> >());
+    handler->methodRegistry.reset(new MethodRegistry_t());
+    handler->responseWriter.reset(new ResponseWriter_t(handler->streamChunkSize));
 
     handler->module->threadCreate();
 }
@@ -70,6 +207,7 @@ CppHttpHandler_t::Worker_t::~Worker_t()
 {
     handler->module->threadDestroy();
 
+    delete handler->responseWriter.release();
     delete handler->methodRegistry.release();
 }
 
@@ -88,16 +226,30 @@ public:
     }
 };
 
+// limits also apply to chunked bodies and bodies longer than announced
+void checkBodySize(size_t size, size_t maxSize)
+{
+    if (maxSize && size > maxSize) {
+        throw CppHttpHandler_t::HttpError_t(413, "Request body exceeds %zu bytes", maxSize);
+    }
+}
+
+const size_t MAX_RESERVE(64 * 1024);
+
 class Reader_t : public FRPC::UnMarshaller_t {
 public:
-    Reader_t(std::string &data)
-      : data(data)
+    Reader_t(std::string &data, size_t contentLength, size_t maxSize)
+      : data(data),
+        maxSize(maxSize)
     {
+        // Content-Length comes from the client, append grows past this
+        data.reserve(std::min(contentLength, MAX_RESERVE));
     }
 
     virtual void unMarshall(const char *dataPart, unsigned int size, char)
     {
-        data += std::string(dataPart, size);
+        checkBodySize(data.size() + size, maxSize);
+        data.append(dataPart, size);
     }
 
     virtual void finish()
@@ -105,8 +257,185 @@ public:
     }
 
     std::string &data;
+    size_t maxSize;
+};
+
+class FormReader_t : public FRPC::UnMarshaller_t {
+public:
+    FormReader_t(CppHttpHandler_t::MimeParameters_t &form, size_t maxSize)
+      : form(form),
+        size(0),
+        maxSize(maxSize)
+    {
+    }
+
+    virtual void unMarshall(const char *dataPart, unsigned int size, char)
+    {
+        this->size += size;
+        checkBodySize(this->size, maxSize);
+        form.feedMultipart(dataPart, size);
+    }
+
+    virtual void finish()
+    {
+    }
+
+    CppHttpHandler_t::MimeParameters_t &form;
+    size_t size;
+    size_t maxSize;
+};
+
+class BodyReader_t : public FRPC::UnMarshaller_t {
+public:
+    BodyReader_t(CppHttpHandler_t::Method_t &method,
+                 const CppHttpHandler_t::Request_t &request,
+                 CppHttpHandler_t::Response_t &response,
+                 size_t maxSize)
+      : method(method),
+        request(request),
+        response(response),
+        size(0),
+        maxSize(maxSize),
+        methodFailed(false)
+    {
+    }
+
+    virtual void unMarshall(const char *dataPart, unsigned int size, char)
+    {
+        this->size += size;
+        checkBodySize(this->size, maxSize);
+        try {
+            method.body(request, response, dataPart, size);
+        } catch (...) {
+            methodFailed = true;
+            throw;
+        }
+    }
+
+    virtual void finish()
+    {
+    }
+
+    CppHttpHandler_t::Method_t &method;
+    const CppHttpHandler_t::Request_t &request;
+    CppHttpHandler_t::Response_t &response;
+    size_t size;
+    size_t maxSize;
+    // tells errors of the method from errors reading the body
+    bool methodFailed;
 };
 
+void sendBadRequest(HttpIo_t &io, const std::string &requestLine)
+{
+    LOG(WARN2, "Bad request: %s", requestLine.c_str());
+    std::string data(
+        "HTTP/1.0 400 Bad Request\r\n"
+        "Server: ThreadServer/CppHttpHandler Linux\r\n\r\n");
+    try {
+        io.sendData(data.c_str(), data.size(), false);
+    } catch (const std::exception &e) {
+        throw Error_t("Can't send data: %s", e.what());
+    }
+}
+
+// sets ETag and Last-Modified, the ETag of buffered GET responses is
+// hashed from the body unless the method supplied its own validator
+void setValidators(const CppHttpHandler_t::Request_t &request,
+                   CppHttpHandler_t::Response_t &response, bool autoETag)
+{
+    if ((response.status != 200 && response.status != 206) || response.streaming()) {
+        return;
+    }
+
+    if (response.etag.empty() && autoETag && response.status == 200 && !response.file.size
+        && (request.method == "GET" || request.method == "HEAD")) {
+
+        // the pieces are chained through the seed, the body is never joined
+        uint64_t hash(hash64(response.data.data(), response.data.size()));
+        for (CppHttpHandler_t::Response_t::Chain_t::const_iterator
+                 ichain(response.chain.begin()) ;
+             ichain != response.chain.end() ;
+             ++ichain) {
+
+            hash = hash64(ichain->data, ichain->size, hash);
+        }
+
+        // weak, the same tag is sent for compressed variants
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), "W/\"%016llx\"", (unsigned long long)hash);
+        response.etag = buffer;
+    }
+
+    if (!response.etag.empty()) {
+        if (response.etag[0] != '"' && response.etag.compare(0, 2, "W/")) {
+            response.etag = '"' + response.etag + '"';
+        }
+        response.headers.set("ETag", response.etag);
+    }
+    if (response.lastModified) {
+        response.headers.set("Last-Modified", formatHttpDate(response.lastModified));
+    }
+}
+
+std::string opaqueTag(const std::string &etag)
+{
+    return etag.compare(0, 2, "W/") ? etag : etag.substr(2);
+}
+
+bool matchesETag(const std::string &ifNoneMatch, const std::string &etag)
+{
+    std::string opaque(opaqueTag(etag));
+    size_t begin(0);
+    while (begin < ifNoneMatch.size()) {
+        size_t end(ifNoneMatch.find(',', begin));
+        if (end == std::string::npos) {
+            end = ifNoneMatch.size();
+        }
+        size_t first(ifNoneMatch.find_first_not_of(" \t", begin));
+        size_t last(ifNoneMatch.find_last_not_of(" \t", end - 1));
+        if (first < end && last != std::string::npos && last >= first) {
+            std::string tag(ifNoneMatch, first, last - first + 1);
+            if (tag == "*" || opaqueTag(tag) == opaque) {
+                return true;
+            }
+        }
+        begin = end + 1;
+    }
+    return false;
+}
+
+// If-None-Match takes precedence over If-Modified-Since
+bool notModified(const CppHttpHandler_t::Request_t &request,
+                 const CppHttpHandler_t::Response_t &response)
+{
+    if ((request.method != "GET" && request.method != "HEAD")
+        || (response.status != 200 && response.status != 206)
+        || response.streaming()) {
+        return false;
+    }
+
+    std::string ifNoneMatch(request.headers[CppHttpHandler_t::Headers_t::IF_NONE_MATCH].str());
+    if (!ifNoneMatch.empty()) {
+        std::string etag;
+        response.headers.get("ETag", etag);
+        return !etag.empty() && matchesETag(ifNoneMatch, etag);
+    }
+
+    std::string ifModifiedSince(
+        request.headers[CppHttpHandler_t::Headers_t::IF_MODIFIED_SINCE].str());
+    if (!ifModifiedSince.empty()) {
+        std::string lastModified;
+        response.headers.get("Last-Modified", lastModified);
+        time_t since;
+        time_t modified;
+        return !lastModified.empty()
+            && parseHttpDate(ifModifiedSince, since)
+            && parseHttpDate(lastModified, modified)
+            && modified <= since;
+    }
+    return false;
+}
+
 }
 
 void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
@@ -123,7 +452,7 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
             handler->readTimeout,
             handler->writeTimeout,
             handler->maxLineSize,
-            handler->maxRequestSize);
+            std::numeric_limits<int>::max());
 
         Request_t request;
 
@@ -162,51 +491,142 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
             }
             request.protocol = splittedRequestLine[2];
 
-            io.readHeader(request.headers);
-            request.contentType = "text/plain";
-            request.headers.get("Content-Type", request.contentType);
-
-            Reader_t reader(request.data);
-            FRPC::DataSink_t dataSink(reader);
-            io.readContent(request.headers, dataSink, true);
-        } catch (...) {
-            LOG(WARN2, "Bad request: %s", requestLine.c_str());
-            std::string data(
-                "HTTP/1.0 400 Bad Request\r\n"
-                "Server: ThreadServer/CppHttpHandler Linux\r\n\r\n");
-            try {
-                io.sendData(data.c_str(), data.size(), false);
-            } catch (const std::exception &e) {
-                throw Error_t("Can't send data: %s", e.what());
+            for (size_t lines(0) ; ; ++lines) {
+                std::string line(io.readLine());
+                if (line.empty()) {
+                    break;
+                }
+                if (lines == handler->maxHeaderLines) {
+                    throw Error_t("Too many HTTP header lines");
+                }
+                request.headers.parse(line);
             }
+            Headers_t::View_t contentType(request.headers[Headers_t::CONTENT_TYPE]);
+            request.contentType = contentType.empty() ? "text/plain" : contentType.str();
+        } catch (...) {
+            sendBadRequest(io, requestLine);
             handler->work.release();
             return;
         }
 
-        Response_t response(request);
+        handler->responseWriter->reset(
+            socket->getSocket()->native(), handler->writeTimeout, request.method == "HEAD");
+        Response_t response(request, handler->responseWriter.get());
         response.contentType = "text/plain";
 
-        std::list<std::pair<boost::regex, Method_t*> >::const_iterator imethodRegistry;
-        for (imethodRegistry = handler->methodRegistry->begin() ;
-             imethodRegistry != handler->methodRegistry->end() ;
-             ++imethodRegistry) {
+        Route_t *route(handler->findRoute(request));
+
+        // everything that can reject the request is checked before the
+        // body is read, so clients waiting for 100 Continue don't send it
+        std::string contentLengthValue(request.headers[Headers_t::CONTENT_LENGTH].str());
+        std::string transferEncoding(request.headers[Headers_t::TRANSFER_ENCODING].str());
+        std::string expect(request.headers[Headers_t::EXPECT].str());
+
+        // FastRPC only needs the framing headers to read the body
+        FRPC::HTTPHeader_t bodyHeaders;
+        if (!contentLengthValue.empty()) {
+            bodyHeaders.set("Content-Length", contentLengthValue);
+        }
+        if (!transferEncoding.empty()) {
+            bodyHeaders.set("Transfer-Encoding", transferEncoding);
+        }
+
+        size_t contentLength(0);
+        if (!contentLengthValue.empty()) {
+            char *end;
+            contentLength = strtoull(contentLengthValue.c_str(), &end, 10);
+            if (*end || contentLengthValue[0] == '-') {
+                sendBadRequest(io, requestLine);
+                handler->work.release();
+                return;
+            }
+        }
+
+        bool hasBody(contentLength || !transferEncoding.empty());
+        bool rejected(false);
+        if (!expect.empty() && strcasecmp(expect.c_str(), "100-continue")) {
+            response.status = 417;
+            response.data = "Unsupported expectation " + expect;
+            rejected = true;
+        } else if (route && route->maxBodySize && contentLength > route->maxBodySize) {
+            response.status = 413;
+            response.data = "Request body too large";
+            rejected = true;
+        } else if (route && hasBody && !expect.empty() && request.protocol == "HTTP/1.1") {
+            static const char continueLine[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            io.sendData(continueLine, sizeof(continueLine) - 1, false);
+        }
 
-            boost::cmatch matches;
-            if (boost::regex_match(request.uri.c_str(), matches, imethodRegistry->first)) {
-                for (size_t i(1) ; i < matches.size() ; ++i) {
-                    request.matchGroups.push_back(std::string(matches[i].first, matches[i].second));
+        bool streamed(route && !rejected && route->method->streamsBody());
+        if (route && !rejected && !streamed) {
+            try {
+                if (handler->multipartSpoolSize && route->method->parsesMultipart()
+                    && (request.method == "POST" || request.method == "PUT")
+                    && request.contentType.find("multipart/form-data") == 0) {
+
+                    request.form.reset(new MimeParameters_t());
+                    request.form->parseQuery(request.unparsedUri);
+                    request.form->beginMultipart(request.contentType,
+                                                 handler->multipartSpoolSize,
+                                                 handler->multipartSpoolDirectory);
+                    FormReader_t reader(*request.form, route->maxBodySize);
+                    FRPC::DataSink_t dataSink(reader);
+                    io.readContent(bodyHeaders, dataSink, true);
+                    request.form->finishMultipart();
+                } else {
+                    Reader_t reader(request.data, contentLength, route->maxBodySize);
+                    FRPC::DataSink_t dataSink(reader);
+                    io.readContent(bodyHeaders, dataSink, true);
                 }
-                break;
+            } catch (const HttpError_t &e) {
+                response.status = e.code();
+                response.data = e.what();
+                rejected = true;
+            } catch (...) {
+                sendBadRequest(io, requestLine);
+                handler->work.release();
+                return;
             }
         }
 
-        if (imethodRegistry != handler->methodRegistry->end()) {
+        std::string cacheKey;
+        ResponseCache_t::Result_t cacheResult(ResponseCache_t::MISS);
+        if (route && route->cachePolicy && !rejected && !streamed && request.method == "GET") {
+            cacheKey = handler->responseCache->key(request, *route->cachePolicy);
+            cacheResult = handler->responseCache->lookup(cacheKey, response);
+        }
+
+        bool failed(rejected);
+        if (route && !rejected && cacheResult == ResponseCache_t::MISS) {
             try {
-                imethodRegistry->second->call(request, response);
+                if (streamed) {
+                    BodyReader_t reader(*route->method, request, response, route->maxBodySize);
+                    try {
+                        FRPC::DataSink_t dataSink(reader);
+                        io.readContent(bodyHeaders, dataSink, true);
+                    } catch (const HttpError_t &e) {
+                        throw;
+                    } catch (const std::exception &e) {
+                        if (reader.methodFailed) {
+                            throw;
+                        }
+                        throw HttpError_t(400, "Malformed request body: %s", e.what());
+                    } catch (...) {
+                        if (reader.methodFailed) {
+                            throw;
+                        }
+                        throw HttpError_t(400, "Malformed request body");
+                    }
+                }
+                route->method->call(request, response);
                 response.headers.set("Content-Type", response.contentType);
+                setValidators(request, response, handler->autoETag);
             } catch (const HttpError_t &e) {
                 response.status = e.code();
                 response.data = e.what();
+                response.chain.clear();
+                response.file = Response_t::FileRange_t();
+                failed = true;
             } catch (const std::exception &e) {
                 if (response.debugLogInfo.empty()) {
                     LOG(ERR3, "Method %s thrown an exception: %s",
@@ -217,6 +637,9 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
                 }
                 response.status = 500;
                 response.data = e.what();
+                response.chain.clear();
+                response.file = Response_t::FileRange_t();
+                failed = true;
             } catch (...) {
                 if (response.debugLogInfo.empty()) {
                     LOG(ERR3, "Method %s thrown an unknown exception",
@@ -227,69 +650,33 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
                 }
                 response.status = 500;
                 response.data = "Unknown exception";
+                response.chain.clear();
+                response.file = Response_t::FileRange_t();
+                failed = true;
+            }
+            if (!cacheKey.empty() && !failed) {
+                handler->responseCache->store(request, cacheKey, *route->cachePolicy, response);
             }
-        } else {
+        } else if (!route && !rejected) {
             response.status = 404;
             response.data += "<html><head><title>404 Not Found</title></head><body><h1>404 Not Found</h1>";
             response.data += "The requested URL " + request.unparsedUri + " was not found on this server.<hr />";
             response.data += "</body></html>";
         }
 
-        std::stringstream output;
-        output << response.protocol << " " << response.status << " ";
-        switch (response.status) {
-        case 100: output << "Continue"; break;
-        case 101: output << "Switching Protocols"; break;
-        case 200: output << "OK"; break;
-        case 201: output << "Created"; break;
-        case 202: output << "Accepted"; break;
-        case 203: output << "Non-Authoritative Information"; break;
-        case 204: output << "No Content"; break;
-        case 205: output << "Reset Content"; break;
-        case 206: output << "Partial Content"; break;
-        case 300: output << "Multiple Choices"; break;
-        case 301: output << "Moved Permanently"; break;
-        case 302: output << "Found"; break;
-        case 303: output << "See Other"; break;
-        case 304: output << "Not Modified"; break;
-        case 305: output << "Use Proxy"; break;
-        case 307: output << "Temporary Redirect"; break;
-        case 400: output << "Bad Request"; break;
-        case 401: output << "Unauthorized"; break;
-        case 402: output << "Payment Required"; break;
-        case 403: output << "Forbidden"; break;
-        case 404: output << "Not Found"; break;
-        case 405: output << "Method Not Allowed"; break;
-        case 406: output << "Not Acceptable"; break;
-        case 407: output << "Proxy Authentication Required"; break;
-        case 408: output << "Request Timeout"; break;
-        case 409: output << "Conflict"; break;
-        case 410: output << "Gone"; break;
-        case 411: output << "Length Required"; break;
-        case 412: output << "Precondition Failed"; break;
-        case 413: output << "Request Entity Too Large"; break;
-        case 414: output << "Request-URI Too Long"; break;
-        case 415: output << "Unsupported Media Type"; break;
-        case 416: output << "Request Range Not Satisfiable"; break;
-        case 417: output << "Expectation Failed"; break;
-        case 500: output << "Internal Server Error"; break;
-        case 501: output << "Not Implemented"; break;
-        case 502: output << "Bad Gateway"; break;
-        case 503: output << "Service Unavailable"; break;
-        case 504: output << "Gateway Timeout"; break;
-        case 505: output << "HTTP Version Not Supported"; break;
-        default:
-            if (!response.statusMessage.empty()) {
-                output << response.statusMessage;
-            } else {
-                output << "Unknown";
+        if (!response.streaming()) {
+            if (!failed && notModified(request, response)) {
+                response.status = 304;
+                response.data.clear();
+                response.chain.clear();
+                response.file = Response_t::FileRange_t();
+            } else if (handler->compressor.get() && !failed) {
+                handler->compressor->compress(request, response);
             }
+            handler->responseWriter->write(response);
+        } else if (!failed) {
+            handler->responseWriter->finish();
         }
-        output << "\r\n" << response.headers << "\r\n";
-        std::string outputStr(output.str());
-
-        io.sendData(outputStr);
-        io.sendData(response.data);
 
         if (!response.dontLog) {
             if (response.status / 100 < 4) {
@@ -318,6 +705,10 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
                 }
             }
         }
+
+        if (cacheResult == ResponseCache_t::STALE) {
+            handler->refreshLater(request, cacheKey);
+        }
     } catch (const std::exception &e) {
         LOG(ERR2, "Exception: %s", e.what());
         handler->work.release();
@@ -330,6 +721,61 @@ void CppHttpHandler_t::Worker_t::handle(boost::shared_ptr<SocketWork_t> socket)
     handler->work.release();
 }
 
+CppHttpHandler_t::Route_t* CppHttpHandler_t::findRoute(Request_t &request)
+{
+    request.matchGroups.clear();
+    for (MethodRegistry_t::iterator imethodRegistry(methodRegistry->begin()) ;
+         imethodRegistry != methodRegistry->end() ;
+         ++imethodRegistry) {
+
+        boost::cmatch matches;
+        if (boost::regex_match(request.uri.c_str(), matches, imethodRegistry->location)) {
+            for (size_t i(1) ; i < matches.size() ; ++i) {
+                request.matchGroups.push_back(std::string(matches[i].first, matches[i].second));
+            }
+            return &*imethodRegistry;
+        }
+    }
+    return 0;
+}
+
+// the client already got the stale response, the refresh must not hold up
+// its connection
+void CppHttpHandler_t::refreshLater(const Request_t &request, const std::string &cacheKey)
+{
+    if (batchWorkers.empty()) {
+        Request_t copy(request);
+        refresh(copy, cacheKey);
+        return;
+    }
+    boost::shared_ptr<ParallelTask_t> task(new Refresh_t(*this, request, cacheKey));
+    batchQueue.enqueue(boost::shared_ptr<Batch_t>(new Batch_t(task)));
+}
+
+void CppHttpHandler_t::refresh(Request_t &request, const std::string &cacheKey)
+{
+    Response_t fresh(request);
+    fresh.contentType = "text/plain";
+    try {
+        Route_t *route(findRoute(request));
+        if (!route || !route->cachePolicy) {
+            throw Error_t("No cached method at %s", request.uri.c_str());
+        }
+        route->method->call(request, fresh);
+        fresh.headers.set("Content-Type", fresh.contentType);
+        setValidators(request, fresh, autoETag);
+        responseCache->store(request, cacheKey, *route->cachePolicy, fresh);
+    } catch (const std::exception &e) {
+        responseCache->abandon(cacheKey);
+        LOG(WARN2, "Can't refresh cached response %s: %s",
+            request.unparsedUri.c_str(), e.what());
+    } catch (...) {
+        responseCache->abandon(cacheKey);
+        LOG(WARN2, "Can't refresh cached response %s: unknown exception",
+            request.unparsedUri.c_str());
+    }
+}
+
 CppHttpHandler_t::DlHandleGuard_t::DlHandleGuard_t(void *handle)
   : handle(handle)
 {
@@ -400,10 +846,118 @@ CppHttpHandler_t::Request_t::Request_t()
 {
 }
 
-CppHttpHandler_t::Response_t::Response_t(const CppHttpHandler_t::Request_t &request)
+CppHttpHandler_t::Response_t::Response_t(const CppHttpHandler_t::Request_t &request,
+                                         CppHttpHandler_t::ResponseWriter_t *writer)
   : Message_t(request.protocol),
     debugLogInfo(),
-    dontLog(false)
+    dontLog(false),
+    cacheable(false),
+    etag(),
+    lastModified(0),
+    chain(),
+    writer(writer)
+{
+}
+
+CppHttpHandler_t::Response_t& CppHttpHandler_t::Response_t::append(const char *data, size_t size)
+{
+    chain.push_back(Buffer_t(data, size));
+    return *this;
+}
+
+CppHttpHandler_t::Response_t& CppHttpHandler_t::Response_t::append(const boost::shared_ptr<const std::string> &data)
+{
+    chain.push_back(Buffer_t(data));
+    return *this;
+}
+
+CppHttpHandler_t::Response_t& CppHttpHandler_t::Response_t::sendFile(int fd, off_t offset, size_t size,
+                                                                     const boost::shared_ptr<void> &owner)
+{
+    file.fd = fd;
+    file.offset = offset;
+    file.size = size;
+    file.owner = owner;
+    return *this;
+}
+
+size_t CppHttpHandler_t::Response_t::bodySize() const
+{
+    size_t result(data.size() + file.size);
+    for (Chain_t::const_iterator ichain(chain.begin()) ;
+         ichain != chain.end() ;
+         ++ichain) {
+
+        result += ichain->size;
+    }
+    return result;
+}
+
+CppHttpHandler_t::Response_t& CppHttpHandler_t::Response_t::write(const char *data, size_t size)
+{
+    if (!writer) {
+        this->data.append(data, size);
+        return *this;
+    }
+
+    if (!writer->headSent()) {
+        headers.set("Content-Type", contentType);
+        writer->writeHead(*this);
+        if (!this->data.empty()) {
+            writer->writeChunk(this->data.data(), this->data.size());
+            this->data.clear();
+        }
+        for (Chain_t::const_iterator ichain(chain.begin()) ;
+             ichain != chain.end() ;
+             ++ichain) {
+
+            writer->writeChunk(ichain->data, ichain->size);
+        }
+        chain.clear();
+    }
+
+    writer->writeChunk(data, size);
+    return *this;
+}
+
+CppHttpHandler_t::Response_t& CppHttpHandler_t::Response_t::write(const std::string &data)
+{
+    return write(data.data(), data.size());
+}
+
+void CppHttpHandler_t::Response_t::flush()
+{
+    if (!writer) {
+        return;
+    }
+    write(0, 0);
+    writer->flush();
+}
+
+bool CppHttpHandler_t::Response_t::streaming() const
+{
+    return writer && writer->headSent();
+}
+
+CppHttpHandler_t::Response_t::FileRange_t::FileRange_t()
+  : fd(-1),
+    offset(0),
+    size(0),
+    owner()
+{
+}
+
+CppHttpHandler_t::Response_t::Buffer_t::Buffer_t(const char *data, size_t size)
+  : data(data),
+    size(size),
+    owner()
+{
+}
+
+CppHttpHandler_t::Response_t::Buffer_t::Buffer_t(const boost::shared_ptr<const std::string> &owner)
+  : data(owner->data()),
+    size(owner->size()),
+    owner(owner)
 {
 }
 
@@ -485,185 +1039,96 @@ CppHttpHandler_t::Method_t::~Method_t()
 {
 }
 
-void CppHttpHandler_t::registerMethod(const std::string &location,
-                                      CppHttpHandler_t::Method_t *method)
-{
-    methodRegistry->push_back(
-        std::make_pair(
-            boost::regex(location),
-            method));
-}
-
-CppHttpHandler_t::Parameters_t::Parameters_t()
-  : data()
+bool CppHttpHandler_t::Method_t::streamsBody() const
 {
+    return false;
 }
 
-void CppHttpHandler_t::Parameters_t::parse(const std::string &params)
+bool CppHttpHandler_t::Method_t::parsesMultipart() const
 {
-    boost::char_separator<char> sep("&");
-    boost::tokenizer<boost::char_separator<char> > tokens(params, sep);
-    BOOST_FOREACH(std::string t, tokens) {
-        size_t pos(t.find("="));
-        if (pos == std::string::npos) {
-            data[unescape(t)].push_back("");
-        } else {
-            data[unescape(t.substr(0, pos))].push_back(unescape(t.substr(pos+1)));
-        }
-    }
+    return false;
 }
 
-int CppHttpHandler_t::Parameters_t::unhex(const char c)
+CppHttpHandler_t::ParallelTask_t::~ParallelTask_t()
 {
-    if (c >= '0' && c <= '9') {
-        return c - '0';
-    }
-    if (c >= 'a' && c <= 'f') {
-        return c - 'a' + 0xa;
-    }
-    if (c >= 'A' && c <= 'F') {
-        return c - 'A' + 0xa;
-    }
-    throw std::runtime_error("invalid hex digit");
 }
 
-std::string CppHttpHandler_t::Parameters_t::unescape(const std::string &s)
+void CppHttpHandler_t::Method_t::body(const Request_t &request, Response_t &response,
+                                      const char *data, size_t size)
 {
-    std::string result;
-    for (size_t i(0) ; i < s.size() ; ++i) {
-        if (s[i] == '+') {
-            result.push_back(' ');
-        } else if (s[i] == '%' && i < s.size() - 2) {
-            int d1, d2;
-            try {
-                d1 = unhex(s[i+1]);
-                d2 = unhex(s[i+2]);
-                result.push_back(char(d1*16+d2));
-                i += 2;
-            } catch (const std::exception &e) {
-                result.push_back(s[i]);
-            }
-        } else {
-            result.push_back(s[i]);
-        }
-    }
-    return result;
 }
 
-bool CppHttpHandler_t::Parameters_t::getFirstBool(const std::string &name) const
-{
-    boost::optional<std::string> data(getFirst<std::string>(name));
-    return data && (*data == "1" || *data == "true" || *data == "on");
-}
-
-std::list<bool> CppHttpHandler_t::Parameters_t::getBool(const std::string &name) const
+void CppHttpHandler_t::registerMethod(const std::string &location,
+                                      CppHttpHandler_t::Method_t *method)
 {
-    std::list<std::string> data(get<std::string>(name));
-    std::list<bool> result;
-    std::transform(data.begin(), data.end(), std::back_inserter(result),
-        boost::lambda::_1 == "1" || boost::lambda::_1 == "true" || boost::lambda::_1 == "on");
-    return result;
+    methodRegistry->push_back(Route_t(location, method,
+        method->streamsBody() ? maxStreamedBodySize : maxRequestSize));
 }
 
-CppHttpHandler_t::MimeParameters_t::File_t::File_t()
-  : data(),
-    contentType(),
-    filename()
+void CppHttpHandler_t::registerMethod(const std::string &location,
+                                      CppHttpHandler_t::Method_t *method,
+                                      const CppHttpHandler_t::CachePolicy_t &cachePolicy)
 {
-}
+    methodRegistry->push_back(Route_t(location, method,
+        method->streamsBody() ? maxStreamedBodySize : maxRequestSize));
+    if (!responseCacheSize) {
+        return;
+    }
 
-CppHttpHandler_t::MimeParameters_t::MimeParameters_t()
-  : CppHttpHandler_t::Parameters_t(),
-    fileData()
-{
+    {
+        boost::mutex::scoped_lock lock(responseCacheMutex);
+        if (!responseCache.get()) {
+            responseCache.reset(new ResponseCache_t(responseCacheSize, responseCacheShards));
+        }
+    }
+    methodRegistry->back().cachePolicy = cachePolicy;
 }
 
-void CppHttpHandler_t::MimeParameters_t::parseMime(const std::string &params)
+void CppHttpHandler_t::setMaxBodySize(const std::string &location, size_t maxBodySize)
 {
-    mimetic::NullCodec nullDecoder;
-    mimetic::Base64::Decoder base64Decoder;
-    mimetic::QP::Decoder qpDecoder;
-
-    mimetic::MimeEntity mimeMessage(params.begin(), params.end());
-    mimetic::MimeEntityList &parts(mimeMessage.body().parts());
-    for (mimetic::MimeEntityList::iterator iparts(parts.begin()) ;
-         iparts != parts.end() ;
-         ++iparts) {
-
-        File_t file;
-        std::string name;
-
-        mimetic::MimeEntity &part(**iparts);
+    for (MethodRegistry_t::reverse_iterator imethodRegistry(methodRegistry->rbegin()) ;
+         imethodRegistry != methodRegistry->rend() ;
+         ++imethodRegistry) {
 
-        mimetic::Header &header(part.header());
-
-        mimetic::ContentType &contentType(header.contentType());
-        file.contentType = contentType.type() + "/" + contentType.subtype();
-
-        mimetic::ContentDisposition &contentDisposition(header.contentDisposition());
-        mimetic::ContentDisposition::ParamList &params(contentDisposition.paramList());
-        for (mimetic::ContentDisposition::ParamList::const_iterator iparams(params.begin()) ;
-             iparams != params.end() ;
-             ++iparams) {
-
-            const mimetic::istring &key(iparams->name());
-            if (key == "name") {
-                name = iparams->value();
-            } else if (key == "filename") {
-                file.filename = iparams->value();
-            }
-        }
-
-        mimetic::Body &body(part.body());
-        if (header.contentTransferEncoding().mechanism() == base64Decoder.name()) {
-            mimetic::code(body.begin(), body.end(), base64Decoder, std::back_inserter(file.data));
-        } else if (header.contentTransferEncoding().mechanism() == qpDecoder.name()) {
-            mimetic::code(body.begin(), body.end(), qpDecoder, std::back_inserter(file.data));
-        } else {
-            mimetic::code(body.begin(), body.end(), nullDecoder, std::back_inserter(file.data));
-        }
-
-        if (file.filename.empty() && file.contentType == "/") {
-            data[name].push_back(file.data);
-        } else {
-            fileData[name].push_back(file);
+        if (imethodRegistry->location.str() == location) {
+            imethodRegistry->maxBodySize = maxBodySize;
+            return;
         }
     }
+    throw Error_t("No method registered at %s", location.c_str());
 }
 
-const std::vector<CppHttpHandler_t::MimeParameters_t::File_t>& CppHttpHandler_t::MimeParameters_t::getFiles(const std::string &name) const
+CppHttpHandler_t::ResponseCache_t::Stats_t CppHttpHandler_t::responseCacheStats() const
 {
-    FileData_t::const_iterator ifileData(fileData.find(name));
-    if (ifileData == fileData.end()) {
-        return empty;
-    } else {
-        return ifileData->second;
+    boost::mutex::scoped_lock lock(responseCacheMutex);
+    if (!responseCache.get()) {
+        return ResponseCache_t::Stats_t();
     }
+    return responseCache->stats();
 }
 
-const std::map<std::vector<size_t>, const CppHttpHandler_t::MimeParameters_t::File_t&>
-CppHttpHandler_t::MimeParameters_t::getIndexedFiles(const std::string &name) const
+JSON::FragmentCache_t& CppHttpHandler_t::fragmentCache()
 {
-    std::map<std::vector<size_t>, const File_t&> result;
-    boost::regex regex(boost::algorithm::replace_all_copy(name, "[]", "\\[([0-9]+)\\]"));
-    for (FileData_t::const_iterator ifileData(fileData.begin()) ;
-         ifileData != fileData.end() ;
-         ++ifileData) {
-
-        std::vector<size_t> indexes;
-        boost::cmatch matches;
-        if (!boost::regex_match(ifileData->first.c_str(), matches, regex)) {
-            continue;
-        }
-
-        for (size_t i(1) ; i < matches.size() ; ++i) {
-            indexes.push_back(boost::lexical_cast<size_t>(std::string(matches[i].first, matches[i].second)));
-        }
+    return fragments;
+}
 
-        result.insert(std::pair<std::vector<size_t>, const File_t&>(indexes, ifileData->second.front()));
-    }
+JSON::Encoding CppHttpHandler_t::negotiateEncoding(const Request_t &request, Response_t &response)
+{
+    JSON::Encoding encoding(JSON::acceptedEncoding(request.headers[Headers_t::ACCEPT].str()));
+    response.contentType = JSON::contentType(encoding);
+    std::string vary;
+    response.headers.get("Vary", vary);
+    response.headers.set("Vary", vary.empty() ? "Accept" : vary + ", Accept");
+    return encoding;
+}
 
-    return result;
+CppHttpHandler_t::Route_t::Route_t(const std::string &location, Method_t *method,
+                                   size_t maxBodySize)
+  : location(location),
+    method(method),
+    maxBodySize(maxBodySize),
+    cachePolicy()
+{
 }
 
 SocketWork_t* CppHttpHandler_t::getWork()
@@ -0,0 +1,104 @@
+
+#include <string.h>
+
+#include <threadserver/handlers/cpphttphandler/hash.h>
+
+namespace ThreadServer {
+
+namespace {
+
+const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t read64(const char *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint32_t read32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint64_t accumulate(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+inline uint64_t merge(uint64_t acc, uint64_t value)
+{
+    acc ^= accumulate(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+} // namespace
+
+uint64_t hash64(const char *data, size_t size, uint64_t seed)
+{
+    const char *end(data + size);
+    uint64_t result;
+
+    if (size >= 32) {
+        uint64_t v1(seed + PRIME1 + PRIME2);
+        uint64_t v2(seed + PRIME2);
+        uint64_t v3(seed);
+        uint64_t v4(seed - PRIME1);
+        const char *limit(end - 32);
+        do {
+            v1 = accumulate(v1, read64(data));
+            v2 = accumulate(v2, read64(data + 8));
+            v3 = accumulate(v3, read64(data + 16));
+            v4 = accumulate(v4, read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        result = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        result = merge(result, v1);
+        result = merge(result, v2);
+        result = merge(result, v3);
+        result = merge(result, v4);
+    } else {
+        result = seed + PRIME5;
+    }
+
+    result += size;
+
+    while (data + 8 <= end) {
+        result ^= accumulate(0, read64(data));
+        result = rotl(result, 27) * PRIME1 + PRIME4;
+        data += 8;
+    }
+    if (data + 4 <= end) {
+        result ^= uint64_t(read32(data)) * PRIME1;
+        result = rotl(result, 23) * PRIME2 + PRIME3;
+        data += 4;
+    }
+    while (data < end) {
+        result ^= uint64_t(static_cast<unsigned char>(*data)) * PRIME5;
+        result = rotl(result, 11) * PRIME1;
+        ++data;
+    }
+
+    result ^= result >> 33;
+    result *= PRIME2;
+    result ^= result >> 29;
+    result *= PRIME3;
+    result ^= result >> 32;
+    return result;
+}
+
+} // namespace ThreadServer
@@ -0,0 +1,326 @@
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+
+namespace ThreadServer {
+
+namespace {
+
+struct Name_t {
+    const char *name;
+    size_t size;
+};
+
+#define NAME(name) { name, sizeof(name) - 1 }
+
+// in the order of CppHttpHandler_t::Headers_t::Id_t
+const Name_t names[] = {
+    NAME("Accept"),
+    NAME("Accept-Encoding"),
+    NAME("Accept-Language"),
+    NAME("Authorization"),
+    NAME("Connection"),
+    NAME("Content-Length"),
+    NAME("Content-Type"),
+    NAME("Cookie"),
+    NAME("Expect"),
+    NAME("Host"),
+    NAME("If-Modified-Since"),
+    NAME("If-None-Match"),
+    NAME("Range"),
+    NAME("Referer"),
+    NAME("Transfer-Encoding"),
+    NAME("User-Agent"),
+    NAME("X-Forwarded-For")
+};
+
+#undef NAME
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+} // namespace
+
+CppHttpHandler_t::Headers_t::View_t::View_t(const char *data, size_t size)
+  : data(data),
+    size(size)
+{
+}
+
+bool CppHttpHandler_t::Headers_t::View_t::empty() const
+{
+    return !size;
+}
+
+std::string CppHttpHandler_t::Headers_t::View_t::str() const
+{
+    return size ? std::string(data, size) : std::string();
+}
+
+CppHttpHandler_t::Headers_t::Headers_t()
+  : buffer(),
+    extraFields(),
+    count(0)
+{
+    for (size_t i(0) ; i < ID_COUNT ; ++i) {
+        first[i] = -1;
+    }
+}
+
+CppHttpHandler_t::Headers_t::Id_t CppHttpHandler_t::Headers_t::id(const char *name, size_t size)
+{
+    if (!size) {
+        return UNKNOWN;
+    }
+
+    // the only known name of this length and first letter, if any
+    Id_t candidate(UNKNOWN);
+    const char first(tolower(name[0]));
+    switch (size) {
+    case 4:
+        candidate = HOST;
+        break;
+    case 5:
+        candidate = RANGE;
+        break;
+    case 6:
+        candidate = first == 'a' ? ACCEPT : first == 'c' ? COOKIE : EXPECT;
+        break;
+    case 7:
+        candidate = REFERER;
+        break;
+    case 10:
+        candidate = first == 'c' ? CONNECTION : USER_AGENT;
+        break;
+    case 12:
+        candidate = CONTENT_TYPE;
+        break;
+    case 13:
+        candidate = first == 'a' ? AUTHORIZATION : IF_NONE_MATCH;
+        break;
+    case 14:
+        candidate = CONTENT_LENGTH;
+        break;
+    case 15:
+        if (first == 'x') {
+            candidate = X_FORWARDED_FOR;
+        } else {
+            candidate = tolower(name[7]) == 'e' ? ACCEPT_ENCODING : ACCEPT_LANGUAGE;
+        }
+        break;
+    case 17:
+        candidate = first == 'i' ? IF_MODIFIED_SINCE : TRANSFER_ENCODING;
+        break;
+    }
+
+    if (candidate != UNKNOWN && !strncasecmp(names[candidate].name, name, size)) {
+        return candidate;
+    }
+    return UNKNOWN;
+}
+
+CppHttpHandler_t::Headers_t::Id_t CppHttpHandler_t::Headers_t::id(const std::string &name)
+{
+    return id(name.data(), name.size());
+}
+
+CppHttpHandler_t::Headers_t::View_t CppHttpHandler_t::Headers_t::operator[](Id_t id) const
+{
+    if (id == UNKNOWN || first[id] < 0) {
+        return View_t();
+    }
+    return value(first[id]);
+}
+
+CppHttpHandler_t::Headers_t::View_t
+CppHttpHandler_t::Headers_t::operator[](const std::string &name) const
+{
+    Id_t nameId(id(name));
+    if (nameId != UNKNOWN) {
+        return (*this)[nameId];
+    }
+    for (size_t i(0) ; i < count ; ++i) {
+        if (matches(field(i), nameId, name)) {
+            return value(i);
+        }
+    }
+    return View_t();
+}
+
+int CppHttpHandler_t::Headers_t::get(const std::string &name, std::string &value,
+                                     int index) const
+{
+    Id_t nameId(id(name));
+    for (size_t i(nameId == UNKNOWN ? 0 : std::max(first[nameId], 0)) ; i < count ; ++i) {
+        if (matches(field(i), nameId, name) && !index--) {
+            value = this->value(i).str();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void CppHttpHandler_t::Headers_t::add(const std::string &name, const std::string &value)
+{
+    Field_t added;
+    added.id = id(name);
+    added.name = buffer.size();
+    added.nameSize = name.size();
+    buffer.append(name);
+    added.value = buffer.size();
+    added.valueSize = value.size();
+    buffer.append(value);
+    push(added);
+}
+
+void CppHttpHandler_t::Headers_t::set(const std::string &name, const std::string &value)
+{
+    remove(name, -1);
+    add(name, value);
+}
+
+void CppHttpHandler_t::Headers_t::remove(const std::string &name, int index)
+{
+    Id_t nameId(id(name));
+    for (size_t i(0) ; i < count ; ) {
+        if (matches(field(i), nameId, name)) {
+            if (index < 0 || !index) {
+                erase(i);
+                if (!index) {
+                    return;
+                }
+                continue;
+            }
+            --index;
+        }
+        ++i;
+    }
+}
+
+size_t CppHttpHandler_t::Headers_t::size() const
+{
+    return count;
+}
+
+CppHttpHandler_t::Headers_t::View_t CppHttpHandler_t::Headers_t::name(size_t index) const
+{
+    const Field_t &nameField(field(index));
+    return View_t(buffer.data() + nameField.name, nameField.nameSize);
+}
+
+CppHttpHandler_t::Headers_t::View_t CppHttpHandler_t::Headers_t::value(size_t index) const
+{
+    const Field_t &valueField(field(index));
+    return View_t(buffer.data() + valueField.value, valueField.valueSize);
+}
+
+void CppHttpHandler_t::Headers_t::parse(const std::string &line)
+{
+    size_t begin(0);
+    while (begin < line.size() && isSpace(line[begin])) {
+        ++begin;
+    }
+    size_t end(line.size());
+    while (end > begin && isSpace(line[end - 1])) {
+        --end;
+    }
+
+    if (begin) {
+        // obsolete line folding, only valid right after another header
+        if (!count || field(count - 1).value + field(count - 1).valueSize != buffer.size()) {
+            throw Error_t("Bad HTTP header: %s", line.substr(0, 30).c_str());
+        }
+        if (begin < end) {
+            buffer.push_back(' ');
+            buffer.append(line, begin, end - begin);
+            field(count - 1).valueSize = buffer.size() - field(count - 1).value;
+        }
+        return;
+    }
+
+    size_t colon(line.find(':'));
+    if (colon == std::string::npos || !colon || isSpace(line[colon - 1])) {
+        throw Error_t("Bad HTTP header: %s", line.substr(0, 30).c_str());
+    }
+
+    size_t value(colon + 1);
+    while (value < end && isSpace(line[value])) {
+        ++value;
+    }
+
+    if (buffer.empty()) {
+        buffer.reserve(1024);
+    }
+
+    Field_t parsed;
+    parsed.id = id(line.data(), colon);
+    parsed.name = buffer.size();
+    parsed.nameSize = colon;
+    buffer.append(line, 0, colon);
+    parsed.value = buffer.size();
+    parsed.valueSize = end - value;
+    buffer.append(line, value, end - value);
+    push(parsed);
+}
+
+CppHttpHandler_t::Headers_t::Field_t& CppHttpHandler_t::Headers_t::field(size_t index)
+{
+    return index < INLINE_FIELDS ? inlineFields[index] : extraFields[index - INLINE_FIELDS];
+}
+
+const CppHttpHandler_t::Headers_t::Field_t&
+CppHttpHandler_t::Headers_t::field(size_t index) const
+{
+    return index < INLINE_FIELDS ? inlineFields[index] : extraFields[index - INLINE_FIELDS];
+}
+
+bool CppHttpHandler_t::Headers_t::matches(const Field_t &field, Id_t id,
+                                          const std::string &name) const
+{
+    if (id != UNKNOWN) {
+        return field.id == id;
+    }
+    return field.id == UNKNOWN && field.nameSize == name.size()
+        && !strncasecmp(buffer.data() + field.name, name.data(), name.size());
+}
+
+void CppHttpHandler_t::Headers_t::push(const Field_t &pushed)
+{
+    if (count < INLINE_FIELDS) {
+        inlineFields[count] = pushed;
+    } else {
+        extraFields.push_back(pushed);
+    }
+    if (pushed.id != UNKNOWN && first[pushed.id] < 0) {
+        first[pushed.id] = count;
+    }
+    ++count;
+}
+
+void CppHttpHandler_t::Headers_t::erase(size_t index)
+{
+    for (size_t i(index) ; i + 1 < count ; ++i) {
+        field(i) = field(i + 1);
+    }
+    --count;
+    if (count >= INLINE_FIELDS) {
+        extraFields.pop_back();
+    }
+
+    for (size_t i(0) ; i < ID_COUNT ; ++i) {
+        first[i] = -1;
+    }
+    for (size_t i(count) ; i-- > 0 ; ) {
+        if (field(i).id != UNKNOWN) {
+            first[field(i).id] = i;
+        }
+    }
+}
+
+} // namespace ThreadServer
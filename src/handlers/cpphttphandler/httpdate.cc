@@ -0,0 +1,41 @@
+
+#include <string.h>
+
+#include <threadserver/handlers/cpphttphandler/httpdate.h>
+
+namespace ThreadServer {
+
+namespace {
+
+const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",
+    "%A, %d-%b-%y %H:%M:%S GMT",
+    "%a %b %d %H:%M:%S %Y"
+};
+
+} // namespace
+
+std::string formatHttpDate(time_t time)
+{
+    struct tm tm;
+    char buffer[64];
+    gmtime_r(&time, &tm);
+    size_t size(strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+    return std::string(buffer, size);
+}
+
+bool parseHttpDate(const std::string &date, time_t &time)
+{
+    for (size_t i(0) ; i < sizeof(formats) / sizeof(formats[0]) ; ++i) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end(strptime(date.c_str(), formats[i], &tm));
+        if (end && !*end) {
+            time = timegm(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace ThreadServer
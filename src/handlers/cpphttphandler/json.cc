@@ -1,275 +1,664 @@
 
-#include <boost/lexical_cast.hpp>
-#include <memory>
-
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <boost/thread/tss.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <threadserver/handlers/cpphttphandler/hash.h>
 #include <threadserver/handlers/cpphttphandler/json.h>
 
 namespace ThreadServer {
 namespace JSON {
 
-Value_t::Value_t()
+class Pool_t::Chunk_t {
+public:
+    char* data()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    Chunk_t *next;
+    size_t size;
+    size_t padding;
+};
+
+namespace {
+
+const size_t MIN_CHUNK_SIZE(16384);
+const size_t MAX_CHUNK_SIZE(1024*1024);
+const size_t MAX_CACHED_CHUNKS(16);
+// structs with more members look names up through a hash table
+const size_t INDEXED_MEMBERS(8);
+
+// chunks released by the pools of one thread
+class ChunkCache_t {
+public:
+    ~ChunkCache_t()
+    {
+        for (size_t i(0) ; i < chunks.size() ; ++i) {
+            free(chunks[i]);
+        }
+    }
+
+    std::vector<void*> chunks;
+};
+
+boost::thread_specific_ptr<ChunkCache_t> chunkCache;
+
+inline size_t align(size_t size)
 {
+    return (size + 7) & ~size_t(7);
 }
 
-Value_t::~Value_t()
+inline bool needsEscape(const char c)
 {
+    return c == '"' || c == '\\' || c == '/' || static_cast<unsigned char>(c) < 0x20;
+}
+
+// first quote, backslash, slash or control character
+inline const char* findEscape(const char *data, const char *end)
+{
+#ifdef __AVX2__
+    {
+        const __m256i quote(_mm256_set1_epi8('"'));
+        const __m256i backslash(_mm256_set1_epi8('\\'));
+        const __m256i slash(_mm256_set1_epi8('/'));
+        const __m256i control(_mm256_set1_epi8(0x1f));
+        for ( ; end - data >= 32 ; data += 32) {
+            __m256i chunk(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)));
+            unsigned mask(_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                                _mm256_cmpeq_epi8(chunk, backslash)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, slash),
+                                _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control)))));
+            if (mask) {
+                return data + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i quote(_mm_set1_epi8('"'));
+    const __m128i backslash(_mm_set1_epi8('\\'));
+    const __m128i slash(_mm_set1_epi8('/'));
+    const __m128i control(_mm_set1_epi8(0x1f));
+    for ( ; end - data >= 16 ; data += 16) {
+        __m128i chunk(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+        int mask(_mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, slash),
+                         _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)))));
+        if (mask) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for ( ; data < end ; ++data) {
+        if (needsEscape(*data)) {
+            break;
+        }
+    }
+    return data;
+}
+
+inline void appendEscape(const char c, std::string &output)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    switch (c) {
+    case '"': output.append("\\\"", 2); break;
+    case '\\': output.append("\\\\", 2); break;
+    case '/': output.append("\\/", 2); break;
+    case '\n': output.append("\\n", 2); break;
+    case '\r': output.append("\\r", 2); break;
+    case '\b': output.append("\\b", 2); break;
+    case '\f': output.append("\\f", 2); break;
+    case '\t': output.append("\\t", 2); break;
+    default: {
+        char escaped[] = { '\\', 'u', '0', '0', hexDigits[(c >> 4) & 0xf], hexDigits[c & 0xf] };
+        output.append(escaped, sizeof(escaped));
+        break;
+    }
+    }
+}
+
+} // namespace
+
+Value_t::Value_t(const Type type)
+  : type(type)
+{
+}
+
+Type Value_t::getType() const
+{
+    return type;
 }
 
 bool Value_t::isNull() const
 {
-    return (getType() == JSON::NullType);
+    return (type == JSON::NullType);
+}
+
+Value_t::operator std::string() const
+{
+    std::string output;
+    serialize(output);
+    return output;
+}
+
+void Value_t::serialize(std::string &output) const
+{
+    switch (type) {
+    case NullType:
+        static_cast<const Null_t*>(this)->serialize(output);
+        break;
+    case StringType:
+        static_cast<const String_t*>(this)->serialize(output);
+        break;
+    case IntType:
+        static_cast<const Int_t*>(this)->serialize(output);
+        break;
+    case DoubleType:
+        static_cast<const Double_t*>(this)->serialize(output);
+        break;
+    case BoolType:
+        static_cast<const Bool_t*>(this)->serialize(output);
+        break;
+    case StructType:
+        static_cast<const Struct_t*>(this)->serialize(output);
+        break;
+    case ArrayType:
+        static_cast<const Array_t*>(this)->serialize(output);
+        break;
+    case RawType:
+        static_cast<const Raw_t*>(this)->serialize(output);
+        break;
+    }
 }
 
 Null_t::Null_t()
+  : Value_t(JSON::NullType)
 {
 }
 
-Null_t::~Null_t()
+void Null_t::serialize(std::string &output) const
 {
+    output.append("null", 4);
 }
 
-Type Null_t::getType() const
+String_t::String_t(const char *data, const size_t size, const bool escaped)
+  : Value_t(JSON::StringType),
+    data(data),
+    size(size),
+    escaped(escaped)
 {
-    return JSON::NullType;
 }
 
-Null_t::operator std::string() const
+void String_t::serialize(std::string &output) const
 {
-    return "null";
+    if (escaped) {
+        output.reserve(output.size() + size + 2);
+        output.push_back('"');
+        output.append(data, size);
+        output.push_back('"');
+    } else {
+        escape(data, size, output);
+    }
 }
 
-String_t::String_t(const std::string &data)
-  : data(data)
+std::string String_t::escape(const std::string &s)
 {
+    std::string result;
+    escape(s.data(), s.size(), result);
+    return result;
 }
 
-String_t::~String_t()
+// clean runs are appended in bulk, only escaped bytes are handled one by one
+void String_t::escape(const char *data, size_t size, std::string &output)
 {
+    const char *end(data + size);
+    output.reserve(output.size() + size + 2);
+    output.push_back('"');
+    while (data < end) {
+        const char *special(findEscape(data, end));
+        output.append(data, special);
+        if (special == end) {
+            break;
+        }
+        appendEscape(*special, output);
+        data = special + 1;
+    }
+    output.push_back('"');
 }
 
-Type String_t::getType() const
+Int_t::Int_t(const long long data)
+  : Value_t(JSON::IntType),
+    data(data)
 {
-    return JSON::StringType;
 }
 
-String_t::operator std::string() const
+void Int_t::serialize(std::string &output) const
 {
-    return escape(data);
+    appendInt(output, data);
 }
 
-std::string String_t::escape(const std::string &s)
+Double_t::Double_t(const double data)
+  : Value_t(JSON::DoubleType),
+    data(data)
+{
+}
+
+void Double_t::serialize(std::string &output) const
+{
+    appendDouble(output, data);
+}
+
+Bool_t::Bool_t(const bool data)
+  : Value_t(JSON::BoolType),
+    data(data)
+{
+}
+
+void Bool_t::serialize(std::string &output) const
+{
+    if (data) {
+        output.append("true", 4);
+    } else {
+        output.append("false", 5);
+    }
+}
+
+Struct_t::Struct_t(Pool_t &pool)
+  : Value_t(JSON::StructType),
+    pool(pool),
+    members(0),
+    size(0),
+    capacity(0),
+    index(0),
+    indexSize(0)
+{
+}
+
+void Struct_t::serialize(std::string &output) const
 {
-    std::string result("\"");
-    for (size_t i(0) ; i < s.size() ; ++i) {
-        if (s[i] == '\n') {
-            result.append("\\n");
-        } else if (s[i] == '\r') {
-            result.append("\\r");
-        } else if (s[i] == '\b') {
-            result.append("\\b");
-        } else if (s[i] == '\f') {
-            result.append("\\f");
-        } else if (s[i] == '\t') {
-            result.append("\\t");
+    output.push_back('{');
+    for (size_t i(0) ; i < size ; ++i) {
+        if (i) {
+            output.push_back(',');
+        }
+        output.append(members[i].name, members[i].nameSize);
+        output.push_back(':');
+        members[i].value->serialize(output);
+    }
+    output.push_back('}');
+}
+
+Struct_t& Struct_t::append(const std::string &name, const Value_t &value)
+{
+    return append(name.data(), name.size(), value);
+}
+
+Struct_t& Struct_t::append(const char *name, size_t nameSize, const Value_t &value)
+{
+    pool.scratch.clear();
+    String_t::escape(name, nameSize, pool.scratch);
+    const uint64_t hash(hash64(pool.scratch.data(), pool.scratch.size()));
+
+    // the last value of a name wins
+    Member_t *member(find(hash));
+    if (member) {
+        member->value = &value;
+        return *this;
+    }
+
+    if (size == capacity) {
+        size_t newCapacity(capacity ? capacity * 2 : 4);
+        Member_t *newMembers(static_cast<Member_t*>(
+            pool.allocate(newCapacity * sizeof(Member_t))));
+        if (size) {
+            memcpy(newMembers, members, size * sizeof(Member_t));
+        }
+        members = newMembers;
+        capacity = newCapacity;
+    }
+
+    members[size].name = pool.copy(pool.scratch.data(), pool.scratch.size());
+    members[size].nameSize = pool.scratch.size();
+    members[size].hash = hash;
+    members[size].value = &value;
+    ++size;
+
+    if (size > INDEXED_MEMBERS) {
+        if (size * 2 > indexSize) {
+            // keep the table at most half full
+            indexSize = indexSize ? indexSize * 2 : 4 * INDEXED_MEMBERS;
+            index = static_cast<size_t*>(pool.allocate(indexSize * sizeof(size_t)));
+            memset(index, 0, indexSize * sizeof(size_t));
+            for (size_t i(0) ; i < size ; ++i) {
+                indexMember(i);
+            }
         } else {
-            if (s[i] == '"' || s[i] == '\\' || s[i] == '/') {
-                result.push_back('\\');
+            indexMember(size - 1);
+        }
+    }
+    return *this;
+}
+
+Struct_t::Member_t* Struct_t::find(uint64_t hash)
+{
+    const std::string &name(pool.scratch);
+    if (!index) {
+        for (size_t i(0) ; i < size ; ++i) {
+            if (members[i].hash == hash && members[i].nameSize == name.size()
+                && !memcmp(members[i].name, name.data(), name.size())) {
+                return &members[i];
             }
-            result.push_back(s[i]);
         }
+        return 0;
     }
-    result.push_back('"');
-    return result;
+
+    const size_t mask(indexSize - 1);
+    for (size_t slot(hash & mask) ; index[slot] ; slot = (slot + 1) & mask) {
+        Member_t &member(members[index[slot] - 1]);
+        if (member.hash == hash && member.nameSize == name.size()
+            && !memcmp(member.name, name.data(), name.size())) {
+            return &member;
+        }
+    }
+    return 0;
 }
 
-Int_t::Int_t(const long long data)
-  : data(data)
+void Struct_t::indexMember(size_t position)
 {
+    const size_t mask(indexSize - 1);
+    size_t slot(members[position].hash & mask);
+    while (index[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    index[slot] = position + 1;
 }
 
-Int_t::~Int_t()
+Array_t::Array_t(Pool_t &pool)
+  : Value_t(JSON::ArrayType),
+    pool(pool),
+    values(0),
+    size(0),
+    capacity(0)
 {
 }
 
-Type Int_t::getType() const
+void Array_t::serialize(std::string &output) const
 {
-    return JSON::IntType;
+    output.push_back('[');
+    for (size_t i(0) ; i < size ; ++i) {
+        if (i) {
+            output.push_back(',');
+        }
+        values[i]->serialize(output);
+    }
+    output.push_back(']');
 }
 
-Int_t::operator std::string() const
+Array_t& Array_t::push_back(const Value_t &value)
 {
-    return boost::lexical_cast<std::string>(data);
+    if (size == capacity) {
+        size_t newCapacity(capacity ? capacity * 2 : 4);
+        const Value_t **newValues(static_cast<const Value_t**>(
+            pool.allocate(newCapacity * sizeof(const Value_t*))));
+        if (size) {
+            memcpy(newValues, values, size * sizeof(const Value_t*));
+        }
+        values = newValues;
+        capacity = newCapacity;
+    }
+
+    values[size++] = &value;
+    return *this;
 }
 
-Double_t::Double_t(const double data)
-  : data(data)
+Raw_t::Raw_t(const char *data, const size_t size)
+  : Value_t(JSON::RawType),
+    data(data),
+    size(size)
 {
 }
 
-Double_t::~Double_t()
+void Raw_t::serialize(std::string &output) const
 {
+    output.append(data, size);
 }
 
-Type Double_t::getType() const
+Fragment_t::Fragment_t(const std::string &data, const unsigned long long version)
+  : data(data),
+    version(version)
 {
-    return JSON::DoubleType;
 }
 
-Double_t::operator std::string() const
+Pool_t::Pool_t()
+  : chunks(0),
+    position(0),
+    end(0),
+    chunkSize(MIN_CHUNK_SIZE),
+    scratch(),
+    fragments(),
+    null()
 {
-    return boost::lexical_cast<std::string>(data);
 }
 
-Bool_t::Bool_t(const bool data)
-  : data(data)
+Pool_t::~Pool_t()
 {
+    clear();
 }
 
-Bool_t::~Bool_t()
+Null_t& Pool_t::Null()
 {
+    return null;
 }
 
-Type Bool_t::getType() const
+String_t& Pool_t::String(const std::string &data)
 {
-    return JSON::BoolType;
+    return String(data.data(), data.size());
 }
 
-Bool_t::operator std::string() const
+String_t& Pool_t::String(const char *data, size_t size)
 {
-    return data ? "true" : "false";
+    const char *copied(copy(data, size));
+    return *new (allocate(sizeof(String_t))) String_t(copied, size, false);
 }
 
-Struct_t::Struct_t()
-  : data()
+String_t& Pool_t::BorrowedString(const std::string &data)
 {
+    return BorrowedString(data.data(), data.size());
 }
 
-Struct_t::~Struct_t()
+String_t& Pool_t::BorrowedString(const char *data, size_t size)
 {
+    return *new (allocate(sizeof(String_t))) String_t(data, size, false);
 }
 
-Type Struct_t::getType() const
+String_t& Pool_t::EscapedString(const char *data, size_t size)
 {
-    return JSON::StructType;
+    return *new (allocate(sizeof(String_t))) String_t(data, size, true);
 }
 
-Struct_t::operator std::string() const
+Int_t& Pool_t::Int(const long long data)
 {
-    std::stringstream output;
-    output << "{";
-    std::string comma;
-    for (std::map<std::string, const Value_t*>::const_iterator idata(data.begin()) ;
-         idata != data.end() ;
-         ++idata) {
+    return *new (allocate(sizeof(Int_t))) Int_t(data);
+}
 
-        output << comma << String_t::escape(idata->first) << ":" << std::string(*idata->second);
-        comma = ",";
-    }
-    output << "}";
-    return output.str();
+Double_t& Pool_t::Double(const double data)
+{
+    return *new (allocate(sizeof(Double_t))) Double_t(data);
 }
 
-Struct_t& Struct_t::append(const std::string &name, const Value_t &value)
+Bool_t& Pool_t::Bool(const bool data)
 {
-    data[name] = &value;
-    return *this;
+    return *new (allocate(sizeof(Bool_t))) Bool_t(data);
 }
 
-Array_t::Array_t()
-  : data()
+Struct_t& Pool_t::Struct()
 {
+    return *new (allocate(sizeof(Struct_t))) Struct_t(*this);
 }
 
-Array_t::~Array_t()
+Array_t& Pool_t::Array()
 {
+    return *new (allocate(sizeof(Array_t))) Array_t(*this);
 }
 
-Type Array_t::getType() const
+Raw_t& Pool_t::Raw(const char *data, size_t size)
 {
-    return JSON::ArrayType;
+    return *new (allocate(sizeof(Raw_t))) Raw_t(data, size);
 }
 
-Array_t::operator std::string() const
+Raw_t& Pool_t::Raw(const std::string &data)
 {
-    std::stringstream output;
-    output << "[";
-    std::string comma;
-    for (std::vector<const Value_t*>::const_iterator idata(data.begin()) ;
-         idata != data.end() ;
-         ++idata) {
+    return Raw(copy(data.data(), data.size()), data.size());
+}
+
+Raw_t& Pool_t::Raw(const boost::shared_ptr<const Fragment_t> &fragment)
+{
+    fragments.push_back(fragment);
+    return Raw(fragment->data.data(), fragment->data.size());
+}
 
-        output << comma << std::string(**idata);
-        comma = ",";
+void Pool_t::clear()
+{
+    fragments.clear();
+
+    if (!chunkCache.get()) {
+        chunkCache.reset(new ChunkCache_t());
     }
-    output << "]";
-    return output.str();
+    std::vector<void*> &cached(chunkCache->chunks);
+    while (chunks) {
+        Chunk_t *chunk(chunks);
+        chunks = chunk->next;
+        if (cached.size() < MAX_CACHED_CHUNKS && chunk->size <= MAX_CHUNK_SIZE) {
+            cached.push_back(chunk);
+        } else {
+            free(chunk);
+        }
+    }
+    position = end = 0;
+    chunkSize = MIN_CHUNK_SIZE;
 }
 
-Array_t& Array_t::push_back(const Value_t &value)
+void* Pool_t::allocate(size_t size)
 {
-    data.push_back(&value);
-    return *this;
+    size = align(size);
+    if (size_t(end - position) < size) {
+        grow(size);
+    }
+    void *result(position);
+    position += size;
+    return result;
 }
 
-Pool_t::Pool_t()
+const char* Pool_t::copy(const char *data, size_t size)
 {
+    char *result(static_cast<char*>(allocate(size + 1)));
+    memcpy(result, data, size);
+    result[size] = '\0';
+    return result;
 }
 
-Pool_t::~Pool_t()
+// chunks double up to MAX_CHUNK_SIZE, bigger requests get a chunk of their own
+void Pool_t::grow(size_t size)
 {
-    for (std::list<Value_t*>::iterator ivalues(values.begin()) ;
-         ivalues != values.end() ;
-         ++ivalues) {
+    size_t wanted(std::max(size, chunkSize));
+    Chunk_t *chunk(0);
 
-        delete *ivalues;
+    ChunkCache_t *cache(chunkCache.get());
+    if (cache) {
+        for (size_t i(cache->chunks.size()) ; i ; --i) {
+            Chunk_t *cached(static_cast<Chunk_t*>(cache->chunks[i - 1]));
+            if (cached->size >= wanted) {
+                chunk = cached;
+                cache->chunks.erase(cache->chunks.begin() + (i - 1));
+                break;
+            }
+        }
+    }
+    if (!chunk) {
+        chunk = static_cast<Chunk_t*>(malloc(sizeof(Chunk_t) + wanted));
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+        chunk->size = wanted;
     }
-}
 
-Null_t& Pool_t::Null()
-{
-    return null;
+    chunk->next = chunks;
+    chunks = chunk;
+    position = chunk->data();
+    end = position + chunk->size;
+    chunkSize = std::min(chunkSize * 2, MAX_CHUNK_SIZE);
 }
 
-String_t& Pool_t::String(const std::string &data)
+FragmentCache_t::FragmentCache_t()
+  : mutex(),
+    fragments()
 {
-    std::auto_ptr<String_t> s(new String_t(data));
-    values.push_back(s.get());
-    return *s.release();
 }
 
-Int_t& Pool_t::Int(const long long data)
+boost::shared_ptr<const Fragment_t> FragmentCache_t::publish(const std::string &name,
+                                                             const unsigned long long version,
+                                                             const Value_t &value)
 {
-    std::auto_ptr<Int_t> i(new Int_t(data));
-    values.push_back(i.get());
-    return *i.release();
+    std::string data;
+    value.serialize(data);
+    return publish(name, version, data);
 }
 
-Double_t& Pool_t::Double(const double data)
+boost::shared_ptr<const Fragment_t> FragmentCache_t::publish(const std::string &name,
+                                                             const unsigned long long version,
+                                                             const std::string &data)
 {
-    std::auto_ptr<Double_t> d(new Double_t(data));
-    values.push_back(d.get());
-    return *d.release();
+    return store(name, boost::shared_ptr<const Fragment_t>(new Fragment_t(data, version)));
 }
 
-Bool_t& Pool_t::Bool(const bool data)
+boost::shared_ptr<const Fragment_t> FragmentCache_t::fetch(const std::string &name,
+                                                           const unsigned long long version) const
 {
-    std::auto_ptr<Bool_t> b(new Bool_t(data));
-    values.push_back(b.get());
-    return *b.release();
+    boost::mutex::scoped_lock lock(mutex);
+    Fragments_t::const_iterator ifragment(fragments.find(name));
+    if (ifragment == fragments.end() || ifragment->second->version < version) {
+        return boost::shared_ptr<const Fragment_t>();
+    }
+    return ifragment->second;
 }
 
-Struct_t& Pool_t::Struct()
+void FragmentCache_t::remove(const std::string &name)
 {
-    std::auto_ptr<Struct_t> s(new Struct_t());
-    values.push_back(s.get());
-    return *s.release();
+    boost::shared_ptr<const Fragment_t> removed;
+    boost::mutex::scoped_lock lock(mutex);
+    Fragments_t::iterator ifragment(fragments.find(name));
+    if (ifragment != fragments.end()) {
+        // released after the lock, readers may still hold the fragment
+        removed = ifragment->second;
+        fragments.erase(ifragment);
+    }
 }
 
-Array_t& Pool_t::Array()
+// the replaced fragment is released after the lock
+boost::shared_ptr<const Fragment_t> FragmentCache_t::store(
+        const std::string &name, const boost::shared_ptr<const Fragment_t> &fragment)
 {
-    std::auto_ptr<Array_t> a(new Array_t());
-    values.push_back(a.get());
-    return *a.release();
+    boost::shared_ptr<const Fragment_t> replaced(fragment);
+    boost::mutex::scoped_lock lock(mutex);
+    boost::shared_ptr<const Fragment_t> &stored(fragments[name]);
+    if (stored && stored->version >= fragment->version) {
+        return stored;
+    }
+    stored.swap(replaced);
+    return stored;
 }
 
 const std::string String(const Json::Value &value)
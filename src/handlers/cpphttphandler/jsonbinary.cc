@@ -0,0 +1,652 @@
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/json.h>
+#include <threadserver/handlers/cpphttphandler/jsonparser.h>
+
+namespace ThreadServer {
+namespace JSON {
+
+namespace {
+
+const size_t MAX_DEPTH(1024);
+
+struct MediaType_t {
+    const char *name;
+    Encoding encoding;
+};
+
+const MediaType_t mediaTypes[] = {
+    { "application/json", JsonEncoding },
+    { "application/msgpack", MessagePackEncoding },
+    { "application/x-msgpack", MessagePackEncoding },
+    { "application/vnd.msgpack", MessagePackEncoding },
+    { "application/cbor", CborEncoding }
+};
+
+// media type of one Accept or Content-Type entry, -1 when unknown
+int mediaType(const char *begin, const char *end)
+{
+    while (begin < end && (*begin == ' ' || *begin == '\t')) {
+        ++begin;
+    }
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    for (size_t i(0) ; i < sizeof(mediaTypes) / sizeof(mediaTypes[0]) ; ++i) {
+        if (strlen(mediaTypes[i].name) == size_t(end - begin)
+            && !strncasecmp(begin, mediaTypes[i].name, end - begin)) {
+            return int(i);
+        }
+    }
+    return -1;
+}
+
+void appendBigEndian(std::string &output, uint64_t value, int bytes)
+{
+    char buffer[8];
+    for (int i(bytes - 1) ; i >= 0 ; --i) {
+        buffer[i] = char(value & 0xff);
+        value >>= 8;
+    }
+    output.append(buffer, bytes);
+}
+
+} // namespace
+
+// writes MessagePack or CBOR; JSON text of raw values, escaped strings and
+// escaped member names is parsed first
+class Encoder_t {
+public:
+    Encoder_t(std::string &output, const Encoding encoding)
+      : output(output),
+        encoding(encoding)
+    {
+    }
+
+    void value(const Value_t &value)
+    {
+        switch (value.type) {
+        case NullType:
+            null();
+            break;
+        case StringType: {
+            const String_t &string(static_cast<const String_t&>(value));
+            if (string.escaped) {
+                escapedString(string.data, string.size);
+            } else {
+                this->string(string.data, string.size);
+            }
+            break;
+        }
+        case IntType:
+            integer(static_cast<const Int_t&>(value).data);
+            break;
+        case DoubleType:
+            real(static_cast<const Double_t&>(value).data);
+            break;
+        case BoolType:
+            boolean(static_cast<const Bool_t&>(value).data);
+            break;
+        case StructType: {
+            const Struct_t &object(static_cast<const Struct_t&>(value));
+            map(object.size);
+            for (size_t i(0) ; i < object.size ; ++i) {
+                const Struct_t::Member_t &member(object.members[i]);
+                if (memchr(member.name, '\\', member.nameSize)) {
+                    json(member.name, member.nameSize);
+                } else {
+                    string(member.name + 1, member.nameSize - 2);
+                }
+                this->value(*member.value);
+            }
+            break;
+        }
+        case ArrayType: {
+            const Array_t &array(static_cast<const Array_t&>(value));
+            this->array(array.size);
+            for (size_t i(0) ; i < array.size ; ++i) {
+                this->value(*array.values[i]);
+            }
+            break;
+        }
+        case RawType: {
+            const Raw_t &raw(static_cast<const Raw_t&>(value));
+            json(raw.data, raw.size);
+            break;
+        }
+        }
+    }
+
+    void node(const Node_t &node)
+    {
+        switch (node.getType()) {
+        case StringType:
+            string(node.data(), node.size());
+            break;
+        case IntType:
+            integer(node.asInt());
+            break;
+        case DoubleType:
+            real(node.asDouble());
+            break;
+        case BoolType:
+            boolean(node.asBool());
+            break;
+        case StructType:
+            map(node.size());
+            for (Node_t::const_iterator inode(node.begin()) ; inode != node.end() ; ++inode) {
+                this->node(inode.name());
+                this->node(*inode);
+            }
+            break;
+        case ArrayType:
+            array(node.size());
+            for (Node_t::const_iterator inode(node.begin()) ; inode != node.end() ; ++inode) {
+                this->node(*inode);
+            }
+            break;
+        default:
+            null();
+            break;
+        }
+    }
+
+private:
+    Encoder_t(const Encoder_t&);
+    Encoder_t& operator=(const Encoder_t&);
+
+    void json(const char *data, size_t size)
+    {
+        Document_t document;
+        document.parse(data, size);
+        node(document.root());
+    }
+
+    // text already escaped for JSON, without the quotes
+    void escapedString(const char *data, size_t size)
+    {
+        if (!memchr(data, '\\', size)) {
+            string(data, size);
+            return;
+        }
+        std::string quoted;
+        quoted.reserve(size + 2);
+        quoted.push_back('"');
+        quoted.append(data, size);
+        quoted.push_back('"');
+        json(quoted.data(), quoted.size());
+    }
+
+    // major type (CBOR) and length
+    void head(unsigned char major, uint64_t size)
+    {
+        if (size < 24) {
+            output.push_back(char((major << 5) | size));
+        } else if (size <= 0xff) {
+            output.push_back(char((major << 5) | 24));
+            appendBigEndian(output, size, 1);
+        } else if (size <= 0xffff) {
+            output.push_back(char((major << 5) | 25));
+            appendBigEndian(output, size, 2);
+        } else if (size <= 0xffffffffULL) {
+            output.push_back(char((major << 5) | 26));
+            appendBigEndian(output, size, 4);
+        } else {
+            output.push_back(char((major << 5) | 27));
+            appendBigEndian(output, size, 8);
+        }
+    }
+
+    // MessagePack type byte and length, the fix form when short enough
+    void head(unsigned char fix, size_t fixLimit, unsigned char base, size_t size)
+    {
+        if (size < fixLimit) {
+            output.push_back(char(fix | size));
+        } else if (base == 0xd9 && size <= 0xff) {
+            output.push_back(char(0xd9));
+            appendBigEndian(output, size, 1);
+        } else if (size <= 0xffff) {
+            output.push_back(char(base == 0xd9 ? 0xda : base));
+            appendBigEndian(output, size, 2);
+        } else {
+            output.push_back(char(base == 0xd9 ? 0xdb : base + 1));
+            appendBigEndian(output, size, 4);
+        }
+    }
+
+    void null()
+    {
+        output.push_back(char(encoding == CborEncoding ? 0xf6 : 0xc0));
+    }
+
+    void boolean(bool value)
+    {
+        if (encoding == CborEncoding) {
+            output.push_back(char(value ? 0xf5 : 0xf4));
+        } else {
+            output.push_back(char(value ? 0xc3 : 0xc2));
+        }
+    }
+
+    void integer(long long value)
+    {
+        if (encoding == CborEncoding) {
+            if (value >= 0) {
+                head(0, uint64_t(value));
+            } else {
+                head(1, uint64_t(-(value + 1)));
+            }
+            return;
+        }
+
+        if (value >= 0) {
+            if (value < 0x80) {
+                output.push_back(char(value));
+            } else if (value <= 0xff) {
+                output.push_back(char(0xcc));
+                appendBigEndian(output, value, 1);
+            } else if (value <= 0xffff) {
+                output.push_back(char(0xcd));
+                appendBigEndian(output, value, 2);
+            } else if (value <= 0xffffffffLL) {
+                output.push_back(char(0xce));
+                appendBigEndian(output, value, 4);
+            } else {
+                output.push_back(char(0xcf));
+                appendBigEndian(output, value, 8);
+            }
+        } else if (value >= -32) {
+            output.push_back(char(value));
+        } else if (value >= -0x80) {
+            output.push_back(char(0xd0));
+            appendBigEndian(output, uint64_t(value), 1);
+        } else if (value >= -0x8000) {
+            output.push_back(char(0xd1));
+            appendBigEndian(output, uint64_t(value), 2);
+        } else if (value >= -0x80000000LL) {
+            output.push_back(char(0xd2));
+            appendBigEndian(output, uint64_t(value), 4);
+        } else {
+            output.push_back(char(0xd3));
+            appendBigEndian(output, uint64_t(value), 8);
+        }
+    }
+
+    void real(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        output.push_back(char(encoding == CborEncoding ? 0xfb : 0xcb));
+        appendBigEndian(output, bits, 8);
+    }
+
+    void string(const char *data, size_t size)
+    {
+        if (encoding == CborEncoding) {
+            head(3, size);
+        } else {
+            head(0xa0, 32, 0xd9, size);
+        }
+        output.append(data, size);
+    }
+
+    void array(size_t size)
+    {
+        if (encoding == CborEncoding) {
+            head(4, size);
+        } else {
+            head(0x90, 16, 0xdc, size);
+        }
+    }
+
+    void map(size_t size)
+    {
+        if (encoding == CborEncoding) {
+            head(5, size);
+        } else {
+            head(0x80, 16, 0xde, size);
+        }
+    }
+
+    std::string &output;
+    const Encoding encoding;
+};
+
+namespace {
+
+// reads MessagePack or CBOR into jsoncpp values, map keys must be strings
+class Decoder_t {
+public:
+    Decoder_t(const char *data, size_t size, const Encoding encoding)
+      : position(reinterpret_cast<const unsigned char*>(data)),
+        end(position + size),
+        encoding(encoding)
+    {
+    }
+
+    void document(Json::Value &value)
+    {
+        if (encoding == CborEncoding) {
+            cbor(value, 0);
+        } else {
+            messagePack(value, 0);
+        }
+        if (position != end) {
+            throw Error_t("Trailing data after %s document",
+                          encoding == CborEncoding ? "CBOR" : "MessagePack");
+        }
+    }
+
+private:
+    uint64_t bigEndian(size_t bytes)
+    {
+        need(bytes);
+        uint64_t result(0);
+        for (size_t i(0) ; i < bytes ; ++i) {
+            result = (result << 8) | *position++;
+        }
+        return result;
+    }
+
+    void need(uint64_t bytes)
+    {
+        if (uint64_t(end - position) < bytes) {
+            throw Error_t("Truncated %s document",
+                          encoding == CborEncoding ? "CBOR" : "MessagePack");
+        }
+    }
+
+    std::string string(uint64_t size)
+    {
+        need(size);
+        std::string result(reinterpret_cast<const char*>(position), size);
+        position += size;
+        return result;
+    }
+
+    static Json::Value integer(long long value)
+    {
+        if (value >= INT_MIN && value <= INT_MAX) {
+            return Json::Value(Json::Int(value));
+        }
+        if (value > 0 && value <= UINT_MAX) {
+            return Json::Value(Json::UInt(value));
+        }
+        return Json::Value(double(value));
+    }
+
+    static Json::Value unsignedInteger(uint64_t value)
+    {
+        if (value <= uint64_t(UINT_MAX)) {
+            return integer(static_cast<long long>(value));
+        }
+        return Json::Value(double(value));
+    }
+
+    static double real(uint64_t bits, size_t bytes)
+    {
+        if (bytes == 4) {
+            uint32_t narrow(static_cast<uint32_t>(bits));
+            float value;
+            memcpy(&value, &narrow, sizeof(value));
+            return value;
+        }
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    void array(Json::Value &value, uint64_t size, size_t depth)
+    {
+        value = Json::Value(Json::arrayValue);
+        for (uint64_t i(0) ; i < size ; ++i) {
+            Json::Value &element(value.append(Json::Value()));
+            if (encoding == CborEncoding) {
+                cbor(element, depth + 1);
+            } else {
+                messagePack(element, depth + 1);
+            }
+        }
+    }
+
+    void map(Json::Value &value, uint64_t size, size_t depth)
+    {
+        value = Json::Value(Json::objectValue);
+        for (uint64_t i(0) ; i < size ; ++i) {
+            Json::Value name;
+            if (encoding == CborEncoding) {
+                cbor(name, depth + 1);
+            } else {
+                messagePack(name, depth + 1);
+            }
+            if (!name.isString()) {
+                throw Error_t("Map keys must be strings");
+            }
+            if (encoding == CborEncoding) {
+                cbor(value[name.asString()], depth + 1);
+            } else {
+                messagePack(value[name.asString()], depth + 1);
+            }
+        }
+    }
+
+    void messagePack(Json::Value &value, size_t depth)
+    {
+        if (depth > MAX_DEPTH) {
+            throw Error_t("MessagePack document nested too deep");
+        }
+        need(1);
+        unsigned char type(*position++);
+        if (type < 0x80) {
+            value = integer(type);
+        } else if (type < 0x90) {
+            map(value, type & 0x0f, depth);
+        } else if (type < 0xa0) {
+            array(value, type & 0x0f, depth);
+        } else if (type < 0xc0) {
+            value = string(type & 0x1f);
+        } else if (type >= 0xe0) {
+            value = integer(static_cast<signed char>(type));
+        } else {
+            switch (type) {
+            case 0xc0: value = Json::Value(); break;
+            case 0xc2: value = Json::Value(false); break;
+            case 0xc3: value = Json::Value(true); break;
+            case 0xc4: value = string(bigEndian(1)); break;
+            case 0xc5: value = string(bigEndian(2)); break;
+            case 0xc6: value = string(bigEndian(4)); break;
+            case 0xca: value = Json::Value(real(bigEndian(4), 4)); break;
+            case 0xcb: value = Json::Value(real(bigEndian(8), 8)); break;
+            case 0xcc: value = integer(bigEndian(1)); break;
+            case 0xcd: value = integer(bigEndian(2)); break;
+            case 0xce: value = integer(bigEndian(4)); break;
+            case 0xcf: value = unsignedInteger(bigEndian(8)); break;
+            case 0xd0: value = integer(int8_t(bigEndian(1))); break;
+            case 0xd1: value = integer(int16_t(bigEndian(2))); break;
+            case 0xd2: value = integer(int32_t(bigEndian(4))); break;
+            case 0xd3: value = integer(int64_t(bigEndian(8))); break;
+            case 0xd9: value = string(bigEndian(1)); break;
+            case 0xda: value = string(bigEndian(2)); break;
+            case 0xdb: value = string(bigEndian(4)); break;
+            case 0xdc: array(value, bigEndian(2), depth); break;
+            case 0xdd: array(value, bigEndian(4), depth); break;
+            case 0xde: map(value, bigEndian(2), depth); break;
+            case 0xdf: map(value, bigEndian(4), depth); break;
+            default:
+                throw Error_t("Unsupported MessagePack type 0x%02x", type);
+            }
+        }
+    }
+
+    // length of a CBOR item, indefinite lengths are not supported
+    uint64_t cborLength(unsigned char info)
+    {
+        if (info < 24) {
+            return info;
+        }
+        switch (info) {
+        case 24: return bigEndian(1);
+        case 25: return bigEndian(2);
+        case 26: return bigEndian(4);
+        case 27: return bigEndian(8);
+        default:
+            throw Error_t("Unsupported CBOR length 0x%02x", info);
+        }
+    }
+
+    void cbor(Json::Value &value, size_t depth)
+    {
+        if (depth > MAX_DEPTH) {
+            throw Error_t("CBOR document nested too deep");
+        }
+        need(1);
+        unsigned char initial(*position++);
+        unsigned char info(initial & 0x1f);
+        switch (initial >> 5) {
+        case 0:
+            value = unsignedInteger(cborLength(info));
+            break;
+        case 1: {
+            uint64_t magnitude(cborLength(info));
+            if (magnitude <= uint64_t(LLONG_MAX)) {
+                value = integer(-1 - static_cast<long long>(magnitude));
+            } else {
+                value = Json::Value(-1.0 - double(magnitude));
+            }
+            break;
+        }
+        case 2:
+        case 3:
+            value = string(cborLength(info));
+            break;
+        case 4:
+            array(value, cborLength(info), depth);
+            break;
+        case 5:
+            map(value, cborLength(info), depth);
+            break;
+        case 6:
+            // tags are dropped, the tagged item is kept
+            cborLength(info);
+            cbor(value, depth + 1);
+            break;
+        default:
+            switch (info) {
+            case 20: value = Json::Value(false); break;
+            case 21: value = Json::Value(true); break;
+            case 22:
+            case 23: value = Json::Value(); break;
+            case 25: value = Json::Value(half(uint16_t(bigEndian(2)))); break;
+            case 26: value = Json::Value(real(bigEndian(4), 4)); break;
+            case 27: value = Json::Value(real(bigEndian(8), 8)); break;
+            default:
+                throw Error_t("Unsupported CBOR simple value 0x%02x", info);
+            }
+            break;
+        }
+    }
+
+    static double half(uint16_t bits)
+    {
+        int exponent((bits >> 10) & 0x1f);
+        int mantissa(bits & 0x3ff);
+        double value;
+        if (!exponent) {
+            value = ldexp(mantissa, -24);
+        } else if (exponent != 31) {
+            value = ldexp(mantissa + 1024, exponent - 25);
+        } else {
+            value = mantissa ? NAN : INFINITY;
+        }
+        return (bits & 0x8000) ? -value : value;
+    }
+
+    const unsigned char *position;
+    const unsigned char *end;
+    const Encoding encoding;
+};
+
+} // namespace
+
+void Value_t::serialize(std::string &output, const Encoding encoding) const
+{
+    if (encoding == JsonEncoding) {
+        serialize(output);
+        return;
+    }
+    Encoder_t encoder(output, encoding);
+    encoder.value(*this);
+}
+
+Encoding contentEncoding(const std::string &contentType)
+{
+    size_t semicolon(contentType.find(';'));
+    int type(mediaType(contentType.data(), contentType.data()
+                       + (semicolon == std::string::npos ? contentType.size() : semicolon)));
+    return (type < 0) ? JsonEncoding : mediaTypes[type].encoding;
+}
+
+Encoding acceptedEncoding(const std::string &accept)
+{
+    Encoding result(JsonEncoding);
+    double best(0.0);
+    const char *entry(accept.c_str());
+    while (*entry) {
+        const char *next(strchr(entry, ','));
+        if (!next) {
+            next = entry + strlen(entry);
+        }
+        const char *parameters(static_cast<const char*>(memchr(entry, ';', next - entry)));
+        int type(mediaType(entry, parameters ? parameters : next));
+        if (type >= 0) {
+            double quality(1.0);
+            for (const char *parameter(parameters) ; parameter && parameter < next ; ) {
+                ++parameter;
+                while (*parameter == ' ' || *parameter == '\t') {
+                    ++parameter;
+                }
+                if ((*parameter == 'q' || *parameter == 'Q') && parameter[1] == '=') {
+                    quality = strtod(parameter + 2, 0);
+                }
+                parameter = static_cast<const char*>(memchr(parameter, ';', next - parameter));
+            }
+            if (quality > best) {
+                best = quality;
+                result = mediaTypes[type].encoding;
+            }
+        }
+        entry = *next ? next + 1 : next;
+    }
+    return result;
+}
+
+const char* contentType(const Encoding encoding)
+{
+    switch (encoding) {
+    case MessagePackEncoding:
+        return "application/msgpack";
+    case CborEncoding:
+        return "application/cbor";
+    default:
+        return "application/json; charset=utf-8";
+    }
+}
+
+void decode(const char *data, size_t size, const Encoding encoding, Json::Value &value)
+{
+    if (encoding == JsonEncoding) {
+        throw Error_t("JSON text has to be parsed, not decoded");
+    }
+    Decoder_t decoder(data, size, encoding);
+    decoder.document(value);
+}
+
+} // namespace JSON
+} // namespace ThreadServer
@@ -0,0 +1,344 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include <threadserver/handlers/cpphttphandler/json.h>
+
+namespace ThreadServer {
+namespace JSON {
+
+namespace {
+
+const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// writes value right-aligned, ending just before end; returns the first digit
+inline char* formatUnsigned(unsigned long long value, char *end)
+{
+    while (value >= 100) {
+        const char *pair(digitPairs + (value % 100) * 2);
+        value /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (value >= 10) {
+        const char *pair(digitPairs + value * 2);
+        *--end = pair[1];
+        *--end = pair[0];
+    } else {
+        *--end = char('0' + value);
+    }
+    return end;
+}
+
+// Grisu2 (Loitsch, "Printing floating-point numbers quickly and accurately
+// with integers"); the digits always read back as the same double and are
+// the shortest such digits for almost all inputs
+
+class DiyFp_t {
+public:
+    DiyFp_t(uint64_t f, int e)
+      : f(f),
+        e(e)
+    {
+    }
+
+    explicit DiyFp_t(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        int exponent(int((bits >> 52) & 0x7ff));
+        uint64_t significand(bits & ((uint64_t(1) << 52) - 1));
+        if (exponent) {
+            f = significand + (uint64_t(1) << 52);
+            e = exponent - 1075;
+        } else {
+            f = significand;
+            e = -1074;
+        }
+    }
+
+    DiyFp_t operator-(const DiyFp_t &other) const
+    {
+        return DiyFp_t(f - other.f, e);
+    }
+
+    // rounded upper 64 bits of the 128 bit product
+    DiyFp_t operator*(const DiyFp_t &other) const
+    {
+        const uint64_t mask(0xffffffff);
+        uint64_t a(f >> 32), b(f & mask), c(other.f >> 32), d(other.f & mask);
+        uint64_t ac(a * c), bc(b * c), ad(a * d), bd(b * d);
+        uint64_t middle((bd >> 32) + (ad & mask) + (bc & mask) + (uint64_t(1) << 31));
+        return DiyFp_t(ac + (ad >> 32) + (bc >> 32) + (middle >> 32), e + other.e + 64);
+    }
+
+    DiyFp_t normalize() const
+    {
+        int shift(__builtin_clzll(f));
+        return DiyFp_t(f << shift, e - shift);
+    }
+
+    // halfway points to the neighbouring doubles, both with the exponent of plus
+    void boundaries(DiyFp_t &minus, DiyFp_t &plus) const
+    {
+        plus = DiyFp_t((f << 1) + 1, e - 1).normalize();
+        if (f == (uint64_t(1) << 52)) {
+            minus = DiyFp_t((f << 2) - 1, e - 2);
+        } else {
+            minus = DiyFp_t((f << 1) - 1, e - 1);
+        }
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+    }
+
+    uint64_t f;
+    int e;
+};
+
+// 10^k for k = -348, -340, ..., 340
+const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+// c = 10^-k such that the exponent of w * c lands in [-60, -32]
+inline DiyFp_t cachedPower(int e, int &k)
+{
+    double dk((-61 - e) * 0.30102999566398114 + 347);
+    int ik(static_cast<int>(dk));
+    if (dk - ik > 0.0) {
+        ++ik;
+    }
+    unsigned index((ik >> 3) + 1);
+    k = -(-348 + int(index << 3));
+    return DiyFp_t(cachedPowersF[index], cachedPowersE[index]);
+}
+
+const uint64_t powersOf10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+inline void roundDigit(char *buffer, int length, uint64_t delta, uint64_t rest,
+                       uint64_t tenKappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= tenKappa
+           && (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+        --buffer[length - 1];
+        rest += tenKappa;
+    }
+}
+
+inline int countDigits(uint32_t n)
+{
+    int count(1);
+    while (n >= 10) {
+        n /= 10;
+        ++count;
+    }
+    return count;
+}
+
+void generateDigits(const DiyFp_t &w, const DiyFp_t &plus, uint64_t delta,
+                    char *buffer, int &length, int &k)
+{
+    const DiyFp_t one(uint64_t(1) << -plus.e, plus.e);
+    const DiyFp_t distance(plus - w);
+    uint32_t integral(uint32_t(plus.f >> -one.e));
+    uint64_t fraction(plus.f & (one.f - 1));
+    int kappa(countDigits(integral));
+    length = 0;
+
+    while (kappa > 0) {
+        uint32_t divisor(uint32_t(powersOf10[kappa - 1]));
+        uint32_t digit(integral / divisor);
+        integral %= divisor;
+        if (digit || length) {
+            buffer[length++] = char('0' + digit);
+        }
+        --kappa;
+        uint64_t rest((uint64_t(integral) << -one.e) + fraction);
+        if (rest <= delta) {
+            k += kappa;
+            roundDigit(buffer, length, delta, rest, powersOf10[kappa] << -one.e, distance.f);
+            return;
+        }
+    }
+
+    for (;;) {
+        fraction *= 10;
+        delta *= 10;
+        char digit(char(fraction >> -one.e));
+        if (digit || length) {
+            buffer[length++] = char('0' + digit);
+        }
+        fraction &= one.f - 1;
+        --kappa;
+        if (fraction < delta) {
+            k += kappa;
+            roundDigit(buffer, length, delta, fraction, one.f,
+                       -kappa < 20 ? distance.f * powersOf10[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+// digits of a positive finite value, value = digits * 10^k
+void grisu2(double value, char *buffer, int &length, int &k)
+{
+    const DiyFp_t v(value);
+    DiyFp_t minus(0, 0), plus(0, 0);
+    v.boundaries(minus, plus);
+
+    const DiyFp_t power(cachedPower(plus.e, k));
+    const DiyFp_t w(v.normalize() * power);
+    DiyFp_t upper(plus * power);
+    DiyFp_t lower(minus * power);
+    ++lower.f;
+    --upper.f;
+    generateDigits(w, upper, upper.f - lower.f, buffer, length, k);
+}
+
+// plain notation while the decimal point is within 21 digits, e.g. 0.001,
+// 1.5, 100, scientific notation otherwise, e.g. 1e+21, 1.5e-7
+char* formatDecimal(const char *digits, int length, int k, char *output)
+{
+    const int point(length + k);
+    if (length <= point && point <= 21) {
+        memcpy(output, digits, length);
+        memset(output + length, '0', point - length);
+        return output + point;
+    }
+    if (0 < point && point <= 21) {
+        memcpy(output, digits, point);
+        output[point] = '.';
+        memcpy(output + point + 1, digits + point, length - point);
+        return output + length + 1;
+    }
+    if (-6 < point && point <= 0) {
+        output[0] = '0';
+        output[1] = '.';
+        memset(output + 2, '0', -point);
+        memcpy(output + 2 - point, digits, length);
+        return output + 2 - point + length;
+    }
+
+    *output++ = digits[0];
+    if (length > 1) {
+        *output++ = '.';
+        memcpy(output, digits + 1, length - 1);
+        output += length - 1;
+    }
+    *output++ = 'e';
+    int exponent(point - 1);
+    if (exponent < 0) {
+        *output++ = '-';
+        exponent = -exponent;
+    } else {
+        *output++ = '+';
+    }
+    char buffer[4];
+    char *first(formatUnsigned(exponent, buffer + sizeof(buffer)));
+    memcpy(output, first, buffer + sizeof(buffer) - first);
+    return output + (buffer + sizeof(buffer) - first);
+}
+
+} // namespace
+
+void appendInt(std::string &output, long long value)
+{
+    char buffer[24];
+    char *end(buffer + sizeof(buffer));
+    char *first(formatUnsigned(value < 0 ? 0ULL - (unsigned long long)(value)
+                                         : (unsigned long long)(value), end));
+    if (value < 0) {
+        *--first = '-';
+    }
+    output.append(first, end);
+}
+
+void appendUnsigned(std::string &output, unsigned long long value)
+{
+    char buffer[24];
+    char *end(buffer + sizeof(buffer));
+    output.append(formatUnsigned(value, end), end);
+}
+
+void appendDouble(std::string &output, double value)
+{
+    // NaN and infinities have no JSON representation
+    if (value != value || value - value != 0) {
+        output.append("null", 4);
+        return;
+    }
+
+    char buffer[40];
+    char *position(buffer);
+    if (value < 0 || (value == 0 && 1 / value < 0)) {
+        *position++ = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        *position++ = '0';
+    } else {
+        char digits[24];
+        int length, k;
+        grisu2(value, digits, length, k);
+        position = formatDecimal(digits, length, k, position);
+    }
+    output.append(buffer, position);
+}
+
+} // namespace JSON
+} // namespace ThreadServer
@@ -0,0 +1,701 @@
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/jsonparser.h>
+
+namespace ThreadServer {
+namespace JSON {
+
+namespace {
+
+const size_t MAX_DEPTH(1024);
+
+const Element_t nullElement = { NullType, 0, 1, { 0 } };
+
+const char* typeName(const Type type)
+{
+    switch (type) {
+    case NullType: return "null";
+    case StringType: return "string";
+    case IntType: return "int";
+    case DoubleType: return "double";
+    case BoolType: return "bool";
+    case StructType: return "struct";
+    case ArrayType: return "array";
+    case RawType: return "raw";
+    }
+    return "unknown";
+}
+
+inline bool isSpace(const char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+inline bool isDigit(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// compact documents have no whitespace between tokens, indented ones long runs
+inline char* skipSpace(char *data, char *end)
+{
+    if (!isSpace(*data)) {
+        return data;
+    }
+#ifdef __SSE2__
+    const __m128i space(_mm_set1_epi8(' '));
+    const __m128i newline(_mm_set1_epi8('\n'));
+    const __m128i cr(_mm_set1_epi8('\r'));
+    const __m128i tab(_mm_set1_epi8('\t'));
+    for ( ; end - data >= 16 ; data += 16) {
+        __m128i chunk(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+        int mask(_mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, tab)))));
+        if (mask != 0xffff) {
+            return data + __builtin_ctz(~mask);
+        }
+    }
+#endif
+    while (isSpace(*data)) {
+        ++data;
+    }
+    return data;
+}
+
+// first quote, backslash or control character
+inline char* findSpecial(char *data, char *end)
+{
+#ifdef __SSE2__
+    const __m128i quote(_mm_set1_epi8('"'));
+    const __m128i backslash(_mm_set1_epi8('\\'));
+    const __m128i control(_mm_set1_epi8(0x1f));
+    for ( ; end - data >= 16 ; data += 16) {
+        __m128i chunk(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+        int mask(_mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control))));
+        if (mask) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for ( ; data < end ; ++data) {
+        if (*data == '"' || *data == '\\' || static_cast<unsigned char>(*data) < 0x20) {
+            break;
+        }
+    }
+    return data;
+}
+
+inline int unhex(const char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 0xa;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 0xa;
+    }
+    return -1;
+}
+
+inline char* encodeUtf8(char *output, const unsigned long codePoint)
+{
+    if (codePoint < 0x80) {
+        *output++ = char(codePoint);
+    } else if (codePoint < 0x800) {
+        *output++ = char(0xc0 | (codePoint >> 6));
+        *output++ = char(0x80 | (codePoint & 0x3f));
+    } else if (codePoint < 0x10000) {
+        *output++ = char(0xe0 | (codePoint >> 12));
+        *output++ = char(0x80 | ((codePoint >> 6) & 0x3f));
+        *output++ = char(0x80 | (codePoint & 0x3f));
+    } else {
+        *output++ = char(0xf0 | (codePoint >> 18));
+        *output++ = char(0x80 | ((codePoint >> 12) & 0x3f));
+        *output++ = char(0x80 | ((codePoint >> 6) & 0x3f));
+        *output++ = char(0x80 | (codePoint & 0x3f));
+    }
+    return output;
+}
+
+} // namespace
+
+class Document_t::Parser_t {
+public:
+    Parser_t(char *begin, char *end, std::vector<Element_t> &elements)
+      : begin(begin),
+        position(begin),
+        end(end),
+        elements(elements)
+    {
+    }
+
+    void parse()
+    {
+        position = skipSpace(position, end);
+        value(0);
+        position = skipSpace(position, end);
+        if (position != end) {
+            fail("unexpected data after value");
+        }
+    }
+
+private:
+    void fail(const char *what)
+    {
+        throw Error_t("Invalid JSON at offset %zu: %s", size_t(position - begin), what);
+    }
+
+    size_t push(const Type type)
+    {
+        Element_t element;
+        element.type = type;
+        element.size = 0;
+        element.next = 1;
+        element.value.integer = 0;
+        elements.push_back(element);
+        return elements.size() - 1;
+    }
+
+    void value(const size_t depth)
+    {
+        switch (*position) {
+        case '{':
+            structure(depth);
+            break;
+        case '[':
+            array(depth);
+            break;
+        case '"':
+            string();
+            break;
+        case 't':
+            literal("true", 4);
+            elements[push(BoolType)].value.boolean = true;
+            break;
+        case 'f':
+            literal("false", 5);
+            elements[push(BoolType)].value.boolean = false;
+            break;
+        case 'n':
+            literal("null", 4);
+            push(NullType);
+            break;
+        default:
+            number();
+            break;
+        }
+    }
+
+    void literal(const char *text, const size_t size)
+    {
+        if (size_t(end - position) < size || memcmp(position, text, size)) {
+            fail("invalid literal");
+        }
+        position += size;
+    }
+
+    void structure(const size_t depth)
+    {
+        if (depth >= MAX_DEPTH) {
+            fail("nesting too deep");
+        }
+        size_t index(push(StructType));
+        size_t count(0);
+        position = skipSpace(position + 1, end);
+        if (*position == '}') {
+            ++position;
+        } else {
+            for (;;) {
+                if (*position != '"') {
+                    fail("expected member name");
+                }
+                string();
+                position = skipSpace(position, end);
+                if (*position != ':') {
+                    fail("expected ':'");
+                }
+                position = skipSpace(position + 1, end);
+                value(depth + 1);
+                ++count;
+                position = skipSpace(position, end);
+                if (*position == ',') {
+                    position = skipSpace(position + 1, end);
+                } else if (*position == '}') {
+                    ++position;
+                    break;
+                } else {
+                    fail("expected ',' or '}'");
+                }
+            }
+        }
+        elements[index].size = count;
+        elements[index].next = elements.size() - index;
+    }
+
+    void array(const size_t depth)
+    {
+        if (depth >= MAX_DEPTH) {
+            fail("nesting too deep");
+        }
+        size_t index(push(ArrayType));
+        size_t count(0);
+        position = skipSpace(position + 1, end);
+        if (*position == ']') {
+            ++position;
+        } else {
+            for (;;) {
+                value(depth + 1);
+                ++count;
+                position = skipSpace(position, end);
+                if (*position == ',') {
+                    position = skipSpace(position + 1, end);
+                } else if (*position == ']') {
+                    ++position;
+                    break;
+                } else {
+                    fail("expected ',' or ']'");
+                }
+            }
+        }
+        elements[index].size = count;
+        elements[index].next = elements.size() - index;
+    }
+
+    // unescapes in place, the result is never longer than the source
+    void string()
+    {
+        char *first(++position);
+        char *output(first);
+        for (;;) {
+            char *special(findSpecial(position, end));
+            if (output != position) {
+                memmove(output, position, special - position);
+            }
+            output += special - position;
+            position = special;
+
+            if (position == end) {
+                fail("unterminated string");
+            }
+            if (*position == '"') {
+                break;
+            }
+            if (*position != '\\') {
+                fail("control character in string");
+            }
+
+            ++position;
+            switch (*position++) {
+            case '"': *output++ = '"'; break;
+            case '\\': *output++ = '\\'; break;
+            case '/': *output++ = '/'; break;
+            case 'b': *output++ = '\b'; break;
+            case 'f': *output++ = '\f'; break;
+            case 'n': *output++ = '\n'; break;
+            case 'r': *output++ = '\r'; break;
+            case 't': *output++ = '\t'; break;
+            case 'u': {
+                unsigned long codePoint(unicode());
+                if (codePoint >= 0xd800 && codePoint < 0xdc00) {
+                    if (position[0] != '\\' || position[1] != 'u') {
+                        fail("missing low surrogate");
+                    }
+                    position += 2;
+                    unsigned long low(unicode());
+                    if (low < 0xdc00 || low >= 0xe000) {
+                        fail("invalid low surrogate");
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+                }
+                output = encodeUtf8(output, codePoint);
+                break;
+            }
+            default:
+                --position;
+                fail("invalid escape");
+            }
+        }
+
+        *output = '\0';
+        ++position;
+
+        size_t index(push(StringType));
+        elements[index].size = output - first;
+        elements[index].value.string = first;
+    }
+
+    unsigned long unicode()
+    {
+        unsigned long codePoint(0);
+        for (int i(0) ; i < 4 ; ++i) {
+            int digit(unhex(position[i]));
+            if (digit < 0) {
+                fail("invalid unicode escape");
+            }
+            codePoint = (codePoint << 4) | digit;
+        }
+        position += 4;
+        return codePoint;
+    }
+
+    // integers that fit long long stay exact, the rest is a double
+    void number()
+    {
+        char *first(position);
+        bool negative(*position == '-');
+        if (negative) {
+            ++position;
+        }
+
+        unsigned long long mantissa(0);
+        bool overflow(false);
+        if (*position == '0') {
+            ++position;
+        } else if (isDigit(*position)) {
+            for ( ; isDigit(*position) ; ++position) {
+                unsigned digit(*position - '0');
+                if (mantissa > (ULLONG_MAX - digit) / 10) {
+                    overflow = true;
+                }
+                mantissa = mantissa * 10 + digit;
+            }
+        } else {
+            fail("unexpected character");
+        }
+
+        bool integral(true);
+        if (*position == '.') {
+            ++position;
+            if (!isDigit(*position)) {
+                fail("invalid number");
+            }
+            while (isDigit(*position)) {
+                ++position;
+            }
+            integral = false;
+        }
+        if (*position == 'e' || *position == 'E') {
+            ++position;
+            if (*position == '+' || *position == '-') {
+                ++position;
+            }
+            if (!isDigit(*position)) {
+                fail("invalid number");
+            }
+            while (isDigit(*position)) {
+                ++position;
+            }
+            integral = false;
+        }
+
+        if (integral && !overflow
+            && mantissa <= (unsigned long long)(LLONG_MAX) + (negative ? 1 : 0)) {
+
+            size_t index(push(IntType));
+            elements[index].value.integer = negative
+                ? (mantissa ? -(long long)(mantissa - 1) - 1 : 0)
+                : (long long)(mantissa);
+        } else {
+            size_t index(push(DoubleType));
+            elements[index].value.real = strtod(first, 0);
+        }
+    }
+
+    char *begin;
+    char *position;
+    char *end;
+    std::vector<Element_t> &elements;
+};
+
+Node_t::const_iterator::const_iterator()
+  : element(&nullElement),
+    members(false)
+{
+}
+
+Node_t::const_iterator::const_iterator(const Element_t *element, bool members)
+  : element(element),
+    members(members)
+{
+}
+
+Node_t Node_t::const_iterator::operator*() const
+{
+    return Node_t(members ? element + 1 : element);
+}
+
+Node_t Node_t::const_iterator::name() const
+{
+    return members ? Node_t(element) : Node_t();
+}
+
+Node_t::const_iterator& Node_t::const_iterator::operator++()
+{
+    if (members) {
+        ++element;
+    }
+    element += element->next;
+    return *this;
+}
+
+bool Node_t::const_iterator::operator==(const const_iterator &other) const
+{
+    return element == other.element;
+}
+
+bool Node_t::const_iterator::operator!=(const const_iterator &other) const
+{
+    return element != other.element;
+}
+
+Node_t::Node_t()
+  : element(&nullElement)
+{
+}
+
+Node_t::Node_t(const Element_t *element)
+  : element(element)
+{
+}
+
+Type Node_t::getType() const
+{
+    return element->type;
+}
+
+bool Node_t::isNull() const
+{
+    return element->type == NullType;
+}
+
+const char* Node_t::data() const
+{
+    if (element->type != StringType) {
+        throw Error_t("Can't get string from %s", typeName(element->type));
+    }
+    return element->value.string;
+}
+
+size_t Node_t::size() const
+{
+    return element->size;
+}
+
+std::string Node_t::asString() const
+{
+    return std::string(data(), element->size);
+}
+
+long long Node_t::asInt() const
+{
+    if (element->type != IntType) {
+        throw Error_t("Can't get int from %s", typeName(element->type));
+    }
+    return element->value.integer;
+}
+
+double Node_t::asDouble() const
+{
+    if (element->type == IntType) {
+        return double(element->value.integer);
+    }
+    if (element->type != DoubleType) {
+        throw Error_t("Can't get double from %s", typeName(element->type));
+    }
+    return element->value.real;
+}
+
+bool Node_t::asBool() const
+{
+    if (element->type != BoolType) {
+        throw Error_t("Can't get bool from %s", typeName(element->type));
+    }
+    return element->value.boolean;
+}
+
+Node_t Node_t::operator[](int index) const
+{
+    if (element->type != ArrayType || index < 0 || size_t(index) >= element->size) {
+        return Node_t();
+    }
+    const Element_t *item(element + 1);
+    while (index--) {
+        item += item->next;
+    }
+    return Node_t(item);
+}
+
+Node_t Node_t::operator[](const std::string &name) const
+{
+    const Element_t *found(find(name.data(), name.size()));
+    return found ? Node_t(found) : Node_t();
+}
+
+Node_t Node_t::operator[](const char *name) const
+{
+    const Element_t *found(find(name, strlen(name)));
+    return found ? Node_t(found) : Node_t();
+}
+
+bool Node_t::has(const std::string &name) const
+{
+    return find(name.data(), name.size());
+}
+
+const Element_t* Node_t::find(const char *name, size_t size) const
+{
+    if (element->type != StructType) {
+        return 0;
+    }
+    const Element_t *member(element + 1);
+    for (size_t i(0) ; i < element->size ; ++i) {
+        if (member->size == size && !memcmp(member->value.string, name, size)) {
+            return member + 1;
+        }
+        ++member;
+        member += member->next;
+    }
+    return 0;
+}
+
+Node_t::const_iterator Node_t::begin() const
+{
+    if (element->type != StructType && element->type != ArrayType) {
+        return end();
+    }
+    return const_iterator(element + 1, element->type == StructType);
+}
+
+Node_t::const_iterator Node_t::end() const
+{
+    return const_iterator(element + element->next, element->type == StructType);
+}
+
+Value_t& Node_t::copy(Pool_t &pool) const
+{
+    return convert(pool, false);
+}
+
+Value_t& Node_t::borrow(Pool_t &pool) const
+{
+    return convert(pool, true);
+}
+
+Value_t& Node_t::convert(Pool_t &pool, bool borrowed) const
+{
+    switch (element->type) {
+    case StringType:
+        if (borrowed) {
+            return pool.BorrowedString(element->value.string, element->size);
+        }
+        return pool.String(element->value.string, element->size);
+    case IntType:
+        return pool.Int(element->value.integer);
+    case DoubleType:
+        return pool.Double(element->value.real);
+    case BoolType:
+        return pool.Bool(element->value.boolean);
+    case StructType: {
+        Struct_t &result(pool.Struct());
+        for (const_iterator ivalue(begin()) ; ivalue != end() ; ++ivalue) {
+            Node_t name(ivalue.name());
+            result.append(name.data(), name.size(), (*ivalue).convert(pool, borrowed));
+        }
+        return result;
+    }
+    case ArrayType: {
+        Array_t &result(pool.Array());
+        for (const_iterator ivalue(begin()) ; ivalue != end() ; ++ivalue) {
+            result.push_back((*ivalue).convert(pool, borrowed));
+        }
+        return result;
+    }
+    default:
+        return pool.Null();
+    }
+}
+
+Document_t::Document_t()
+  : buffer(),
+    elements()
+{
+}
+
+void Document_t::parse(const char *data, size_t size)
+{
+    // the terminating NUL stops scanning of numbers and literals
+    buffer.assign(data, data + size);
+    buffer.push_back('\0');
+    elements.clear();
+    elements.reserve(size / 16 + 1);
+
+    Parser_t parser(&buffer[0], &buffer[0] + size, elements);
+    try {
+        parser.parse();
+    } catch (...) {
+        elements.clear();
+        throw;
+    }
+}
+
+void Document_t::parse(const std::string &data)
+{
+    parse(data.data(), data.size());
+}
+
+Node_t Document_t::root() const
+{
+    return elements.empty() ? Node_t() : Node_t(&elements[0]);
+}
+
+const std::string String(const Node_t &node)
+{
+    return node.asString();
+}
+
+const long long Int(const Node_t &node)
+{
+    return node.asInt();
+}
+
+const double Double(const Node_t &node)
+{
+    return node.asDouble();
+}
+
+const bool Bool(const Node_t &node)
+{
+    return node.asBool();
+}
+
+const Node_t& Struct(const Node_t &node)
+{
+    if (node.getType() != StructType) {
+        throw ThreadServer::Error_t("Can't get struct from %s", typeName(node.getType()));
+    }
+    return node;
+}
+
+const Node_t& Array(const Node_t &node)
+{
+    if (node.getType() != ArrayType) {
+        throw ThreadServer::Error_t("Can't get array from %s", typeName(node.getType()));
+    }
+    return node;
+}
+
+} // namespace JSON
+} // namespace ThreadServer
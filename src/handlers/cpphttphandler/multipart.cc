@@ -0,0 +1,759 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+
+namespace ThreadServer {
+
+namespace {
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// umask can only be read by setting it, done once while loading
+mode_t currentUmask()
+{
+    mode_t mask(umask(022));
+    umask(mask);
+    return mask;
+}
+
+// saved files get the mode open(2) gives them with 0644
+const mode_t SAVED_FILE_MODE(0644 & ~currentUmask());
+
+std::string trim(const std::string &value)
+{
+    size_t begin(0);
+    size_t end(value.size());
+    while (begin < end && isSpace(value[begin])) {
+        ++begin;
+    }
+    while (end > begin && isSpace(value[end - 1])) {
+        --end;
+    }
+    return value.substr(begin, end - begin);
+}
+
+// value of a parameter in a header like: form-data; name="a"; filename="b"
+bool headerParameter(const std::string &header, const char *name, std::string &value)
+{
+    size_t nameSize(strlen(name));
+    size_t pos(header.find(';'));
+    while (pos != std::string::npos && pos < header.size()) {
+        ++pos;
+        while (pos < header.size() && isSpace(header[pos])) {
+            ++pos;
+        }
+        size_t keyEnd(pos);
+        while (keyEnd < header.size() && header[keyEnd] != '='
+               && header[keyEnd] != ';' && !isSpace(header[keyEnd])) {
+            ++keyEnd;
+        }
+        bool matches(keyEnd - pos == nameSize
+                     && !strncasecmp(header.data() + pos, name, nameSize));
+
+        pos = keyEnd;
+        while (pos < header.size() && isSpace(header[pos])) {
+            ++pos;
+        }
+        if (pos >= header.size() || header[pos] != '=') {
+            pos = header.find(';', pos);
+            continue;
+        }
+        ++pos;
+        while (pos < header.size() && isSpace(header[pos])) {
+            ++pos;
+        }
+
+        std::string parsed;
+        if (pos < header.size() && header[pos] == '"') {
+            for (++pos ; pos < header.size() && header[pos] != '"' ; ++pos) {
+                if (header[pos] == '\\' && pos + 1 < header.size()) {
+                    ++pos;
+                }
+                parsed.push_back(header[pos]);
+            }
+            pos = header.find(';', pos);
+        } else {
+            size_t end(header.find(';', pos));
+            parsed = trim(header.substr(pos, end == std::string::npos ? end : end - pos));
+            pos = end;
+        }
+
+        if (matches) {
+            value = parsed;
+            return true;
+        }
+    }
+    return false;
+}
+
+int base64Value(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+// skips line breaks and anything else outside the alphabet
+void decodeBase64(const char *data, size_t size, std::string &result)
+{
+    result.reserve(size / 4 * 3);
+    unsigned int bits(0);
+    int count(0);
+    for (const char *end(data + size) ; data < end && *data != '=' ; ++data) {
+        int value(base64Value(*data));
+        if (value < 0) {
+            continue;
+        }
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            result.push_back(char((bits >> count) & 0xff));
+        }
+    }
+}
+
+int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 0xa;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 0xa;
+    }
+    return -1;
+}
+
+void decodeQuotedPrintable(const char *data, size_t size, std::string &result)
+{
+    result.reserve(size);
+    const char *end(data + size);
+    while (data < end) {
+        if (*data != '=') {
+            result.push_back(*data++);
+        } else if (end - data > 2 && hexValue(data[1]) >= 0 && hexValue(data[2]) >= 0) {
+            result.push_back(char(hexValue(data[1]) * 16 + hexValue(data[2])));
+            data += 3;
+        } else if (end - data > 2 && data[1] == '\r' && data[2] == '\n') {
+            data += 3;
+        } else if (end - data > 1 && data[1] == '\n') {
+            data += 2;
+        } else {
+            result.push_back(*data++);
+        }
+    }
+}
+
+const char* find(const char *data, const char *end, const std::string &what)
+{
+    return static_cast<const char*>(memmem(data, end - data, what.data(), what.size()));
+}
+
+} // namespace
+
+CppHttpHandler_t::MultipartParser_t::Sink_t::~Sink_t()
+{
+}
+
+CppHttpHandler_t::MultipartParser_t::MultipartParser_t(const std::string &boundary,
+                                                       Sink_t &sink,
+                                                       size_t maxHeaderSize)
+  : delimiter("\r\n--" + boundary),
+    sink(sink),
+    maxHeaderSize(maxHeaderSize),
+    state(PREAMBLE),
+    start(true),
+    pending()
+{
+}
+
+bool CppHttpHandler_t::MultipartParser_t::boundary(const std::string &contentType,
+                                                   std::string &boundary)
+{
+    return headerParameter(contentType, "boundary", boundary)
+        && !boundary.empty() && boundary.size() <= 70;
+}
+
+void CppHttpHandler_t::MultipartParser_t::feed(const char *data, size_t size)
+{
+    if (pending.empty()) {
+        size_t consumed(process(data, size));
+        pending.assign(data + consumed, size - consumed);
+    } else {
+        pending.append(data, size);
+        pending.erase(0, process(pending.data(), pending.size()));
+    }
+}
+
+void CppHttpHandler_t::MultipartParser_t::finish()
+{
+    if (state != END) {
+        throw HttpError_t(400, "Unterminated multipart body");
+    }
+}
+
+size_t CppHttpHandler_t::MultipartParser_t::process(const char *data, size_t size)
+{
+    const char *position(data);
+    const char *end(data + size);
+    for (;;) {
+        switch (state) {
+        case PREAMBLE: {
+            // the first delimiter may start the body without the CRLF
+            if (start) {
+                size_t available(std::min(size_t(end - position), delimiter.size() - 2));
+                if (memcmp(position, delimiter.data() + 2, available)) {
+                    start = false;
+                } else if (available < delimiter.size() - 2) {
+                    return position - data;
+                } else {
+                    start = false;
+                    position += available;
+                    state = DELIMITER;
+                    break;
+                }
+            }
+
+            const char *found(find(position, end, delimiter));
+            if (!found) {
+                if (size_t(end - position) >= delimiter.size()) {
+                    position = end - (delimiter.size() - 1);
+                }
+                return position - data;
+            }
+            position = found + delimiter.size();
+            state = DELIMITER;
+            break;
+        }
+
+        case DELIMITER: {
+            if (end - position < 2) {
+                return position - data;
+            }
+            if (position[0] == '-' && position[1] == '-') {
+                state = END;
+                break;
+            }
+
+            // transport padding may follow the delimiter
+            const char *lineEnd(position);
+            while (lineEnd < end && isSpace(*lineEnd)) {
+                ++lineEnd;
+            }
+            if (end - lineEnd < 2) {
+                if (lineEnd - position > 1024) {
+                    throw HttpError_t(400, "Bad multipart delimiter");
+                }
+                return position - data;
+            }
+            if (lineEnd[0] != '\r' || lineEnd[1] != '\n') {
+                throw HttpError_t(400, "Bad multipart delimiter");
+            }
+            position = lineEnd + 2;
+            state = HEADERS;
+            break;
+        }
+
+        case HEADERS: {
+            Headers_t headers;
+            if (end - position >= 2 && position[0] == '\r' && position[1] == '\n') {
+                position += 2;
+            } else {
+                static const std::string headersEnd("\r\n\r\n");
+                const char *found(find(position, end, headersEnd));
+                if (!found) {
+                    if (size_t(end - position) > maxHeaderSize) {
+                        throw HttpError_t(400, "Multipart headers too large");
+                    }
+                    return position - data;
+                }
+
+                try {
+                    while (position < found + 2) {
+                        const char *lineEnd(find(position, found + 2, "\r\n"));
+                        headers.parse(std::string(position, lineEnd));
+                        position = lineEnd + 2;
+                    }
+                } catch (const Error_t &e) {
+                    throw HttpError_t(400, std::string(e.what()));
+                }
+                position = found + 4;
+            }
+            sink.partBegin(headers);
+            state = BODY;
+            break;
+        }
+
+        case BODY: {
+            const char *found(find(position, end, delimiter));
+            if (found) {
+                if (found != position) {
+                    sink.partData(position, found - position);
+                }
+                sink.partEnd();
+                position = found + delimiter.size();
+                state = DELIMITER;
+                break;
+            }
+
+            // keep only a tail that may be the beginning of the delimiter
+            const char *safe(end - std::min(size_t(end - position), delimiter.size() - 1));
+            while (safe < end && memcmp(safe, delimiter.data(), end - safe)) {
+                ++safe;
+            }
+            if (safe != position) {
+                sink.partData(position, safe - position);
+            }
+            return safe - data;
+        }
+
+        case END:
+            return size;
+        }
+    }
+}
+
+class CppHttpHandler_t::MimeParameters_t::File_t::Spool_t {
+public:
+    Spool_t(const std::string &directory)
+      : fd(-1),
+        path(directory + "/threadserver-upload-XXXXXX"),
+        linked(true)
+    {
+        fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd < 0) {
+            throw HttpError_t(500, "Can't create spool file in %s: %s",
+                              directory.c_str(), strerror(errno));
+        }
+    }
+
+    ~Spool_t()
+    {
+        ::close(fd);
+        if (linked) {
+            unlink(path.c_str());
+        }
+    }
+
+    void write(const char *data, size_t size)
+    {
+        while (size) {
+            ssize_t written(::write(fd, data, size));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw HttpError_t(500, "Can't write spool file %s: %s",
+                                  path.c_str(), strerror(errno));
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    int fd;
+    std::string path;
+    bool linked;
+};
+
+class CppHttpHandler_t::MimeParameters_t::Collector_t : public MultipartParser_t::Sink_t {
+public:
+    Collector_t(MimeParameters_t &parameters, bool streaming = false, size_t spoolSize = 0,
+                const std::string &spoolDirectory = std::string())
+      : parameters(parameters),
+        streaming(streaming),
+        spoolSize(spoolSize),
+        spoolDirectory(spoolDirectory),
+        name(),
+        file(),
+        encoding(),
+        first(0),
+        size(0),
+        copy()
+    {
+    }
+
+    virtual void partBegin(const Headers_t &headers)
+    {
+        name.clear();
+        file = File_t();
+        std::string disposition(headers["Content-Disposition"].str());
+        headerParameter(disposition, "name", name);
+        headerParameter(disposition, "filename", file.filename);
+
+        std::string contentType(headers[Headers_t::CONTENT_TYPE].str());
+        file.contentType = trim(contentType.substr(0, contentType.find(';')));
+
+        encoding = trim(headers["Content-Transfer-Encoding"].str());
+        first = 0;
+        size = 0;
+        copy.reset();
+    }
+
+    // pieces of one part are contiguous when the whole body was fed at once,
+    // streamed data has to be copied or spooled
+    virtual void partData(const char *data, size_t size)
+    {
+        if (file.spool) {
+            file.spool->write(data, size);
+        } else if (streaming) {
+            if (!copy) {
+                copy.reset(new std::string());
+            }
+            copy->append(data, size);
+            if (spoolSize && copy->size() > spoolSize
+                && !(file.filename.empty() && file.contentType.empty())) {
+                // spool files hold the part as sent, encoded ones would
+                // have to be decoded in memory anyway
+                if (!encoding.empty()) {
+                    throw HttpError_t(413, "Encoded multipart file exceeds %zu bytes",
+                                      spoolSize);
+                }
+                file.spool.reset(new File_t::Spool_t(spoolDirectory));
+                file.spool->write(copy->data(), copy->size());
+                copy.reset();
+            }
+        } else if (copy) {
+            copy->append(data, size);
+        } else if (!first) {
+            first = data;
+            this->size = size;
+        } else if (first + this->size == data) {
+            this->size += size;
+        } else {
+            copy.reset(new std::string(first, this->size));
+            copy->append(data, size);
+        }
+    }
+
+    virtual void partEnd()
+    {
+        if (file.spool) {
+            file.path = file.spool->path;
+            file.fd = file.spool->fd;
+            off_t end(lseek(file.fd, 0, SEEK_CUR));
+            if (end < 0 || lseek(file.fd, 0, SEEK_SET) < 0) {
+                throw HttpError_t(500, "Can't seek spool file %s: %s",
+                                  file.path.c_str(), strerror(errno));
+            }
+            file.size = end;
+            parameters.fileData[name].push_back(file);
+            parameters.filesIndexed = false;
+            return;
+        }
+
+        const char *data(copy ? copy->data() : first);
+        size_t size(copy ? copy->size() : this->size);
+        boost::shared_ptr<std::string> owner(copy);
+        if (!strcasecmp(encoding.c_str(), "base64")) {
+            owner.reset(new std::string());
+            decodeBase64(data, size, *owner);
+        } else if (!strcasecmp(encoding.c_str(), "quoted-printable")) {
+            owner.reset(new std::string());
+            decodeQuotedPrintable(data, size, *owner);
+        }
+        if (owner) {
+            data = owner->data();
+            size = owner->size();
+        }
+
+        if (file.filename.empty() && file.contentType.empty()) {
+            if (owner) {
+                parameters.add(name, *owner);
+            } else {
+                parameters.add(name, data, size);
+            }
+        } else {
+            file.data = File_t::Data_t(data, size, owner);
+            file.size = size;
+            parameters.fileData[name].push_back(file);
+            parameters.filesIndexed = false;
+        }
+    }
+
+private:
+    MimeParameters_t &parameters;
+    bool streaming;
+    size_t spoolSize;
+    std::string spoolDirectory;
+    std::string name;
+    File_t file;
+    std::string encoding;
+    const char *first;
+    size_t size;
+    boost::shared_ptr<std::string> copy;
+};
+
+CppHttpHandler_t::MimeParameters_t::File_t::Data_t::Data_t()
+  : pointer(0),
+    length(0),
+    owner()
+{
+}
+
+CppHttpHandler_t::MimeParameters_t::File_t::Data_t::Data_t(
+        const char *data, size_t size, const boost::shared_ptr<const std::string> &owner)
+  : pointer(data),
+    length(size),
+    owner(owner)
+{
+}
+
+const char* CppHttpHandler_t::MimeParameters_t::File_t::Data_t::data() const
+{
+    return pointer;
+}
+
+size_t CppHttpHandler_t::MimeParameters_t::File_t::Data_t::size() const
+{
+    return length;
+}
+
+bool CppHttpHandler_t::MimeParameters_t::File_t::Data_t::empty() const
+{
+    return !length;
+}
+
+const char* CppHttpHandler_t::MimeParameters_t::File_t::Data_t::begin() const
+{
+    return pointer;
+}
+
+const char* CppHttpHandler_t::MimeParameters_t::File_t::Data_t::end() const
+{
+    return pointer + length;
+}
+
+std::string CppHttpHandler_t::MimeParameters_t::File_t::Data_t::str() const
+{
+    return length ? std::string(pointer, length) : std::string();
+}
+
+CppHttpHandler_t::MimeParameters_t::File_t::Data_t::operator std::string() const
+{
+    return str();
+}
+
+CppHttpHandler_t::MimeParameters_t::File_t::File_t()
+  : data(),
+    contentType(),
+    filename(),
+    path(),
+    fd(-1),
+    size(0),
+    spool()
+{
+}
+
+void CppHttpHandler_t::MimeParameters_t::File_t::save(const std::string &path) const
+{
+    if (!spool) {
+        int fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (fd < 0) {
+            throw Error_t("Can't create %s: %s", path.c_str(), strerror(errno));
+        }
+        const char *begin(data.data());
+        size_t left(data.size());
+        while (left) {
+            ssize_t written(::write(fd, begin, left));
+            if (written < 0 && errno != EINTR) {
+                int error(errno);
+                ::close(fd);
+                throw Error_t("Can't write %s: %s", path.c_str(), strerror(error));
+            }
+            if (written > 0) {
+                begin += written;
+                left -= written;
+            }
+        }
+        ::close(fd);
+        return;
+    }
+
+    if (!rename(spool->path.c_str(), path.c_str())) {
+        spool->path = path;
+        spool->linked = false;
+        // mkostemp created it 0600
+        if (fchmod(spool->fd, SAVED_FILE_MODE)) {
+            throw Error_t("Can't chmod %s: %s", path.c_str(), strerror(errno));
+        }
+        return;
+    }
+    if (errno != EXDEV) {
+        throw Error_t("Can't rename %s to %s: %s",
+                      spool->path.c_str(), path.c_str(), strerror(errno));
+    }
+
+    int fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd < 0) {
+        throw Error_t("Can't create %s: %s", path.c_str(), strerror(errno));
+    }
+    off_t offset(0);
+    while (size_t(offset) < size) {
+        ssize_t sent(sendfile(fd, spool->fd, &offset, size - offset));
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            int error(sent ? errno : EIO);
+            ::close(fd);
+            throw Error_t("Can't copy %s to %s: %s",
+                          spool->path.c_str(), path.c_str(), strerror(error));
+        }
+    }
+    ::close(fd);
+}
+
+CppHttpHandler_t::MimeParameters_t::MimeParameters_t()
+  : CppHttpHandler_t::Parameters_t(),
+    fileData(),
+    empty(),
+    indexedFiles(),
+    filesIndexed(false),
+    collector(),
+    parser()
+{
+}
+
+void CppHttpHandler_t::MimeParameters_t::parseMultipart(const std::string &contentType,
+                                                        const char *data, size_t size)
+{
+    std::string boundary;
+    if (!MultipartParser_t::boundary(contentType, boundary)) {
+        throw HttpError_t(400, "Missing multipart boundary");
+    }
+
+    Collector_t collector(*this);
+    MultipartParser_t parser(boundary, collector);
+    parser.feed(data, size);
+    parser.finish();
+}
+
+void CppHttpHandler_t::MimeParameters_t::beginMultipart(const std::string &contentType,
+                                                        size_t spoolSize,
+                                                        const std::string &spoolDirectory)
+{
+    std::string boundary;
+    if (!MultipartParser_t::boundary(contentType, boundary)) {
+        throw HttpError_t(400, "Missing multipart boundary");
+    }
+
+    collector.reset(new Collector_t(*this, true, spoolSize, spoolDirectory));
+    parser.reset(new MultipartParser_t(boundary, *collector));
+}
+
+void CppHttpHandler_t::MimeParameters_t::feedMultipart(const char *data, size_t size)
+{
+    parser->feed(data, size);
+}
+
+void CppHttpHandler_t::MimeParameters_t::finishMultipart()
+{
+    parser->finish();
+    parser.reset();
+    collector.reset();
+}
+
+void CppHttpHandler_t::MimeParameters_t::parseMime(const std::string &params)
+{
+    const std::string &copy(own(params));
+    size_t headersEnd(copy.find("\r\n\r\n"));
+    if (headersEnd == std::string::npos) {
+        throw HttpError_t(400, "Missing multipart headers");
+    }
+
+    Headers_t headers;
+    size_t position(0);
+    while (position < headersEnd) {
+        size_t lineEnd(copy.find("\r\n", position));
+        headers.parse(copy.substr(position, lineEnd - position));
+        position = lineEnd + 2;
+    }
+    parseMultipart(headers[Headers_t::CONTENT_TYPE].str(),
+                   copy.data() + headersEnd + 4, copy.size() - headersEnd - 4);
+}
+
+const std::vector<CppHttpHandler_t::MimeParameters_t::File_t>& CppHttpHandler_t::MimeParameters_t::getFiles(const std::string &name) const
+{
+    FileData_t::const_iterator ifileData(fileData.find(name));
+    if (ifileData == fileData.end()) {
+        return empty;
+    } else {
+        return ifileData->second;
+    }
+}
+
+const std::map<std::vector<size_t>, const CppHttpHandler_t::MimeParameters_t::File_t&>
+CppHttpHandler_t::MimeParameters_t::getIndexedFiles(const std::string &name) const
+{
+    indexFiles();
+
+    std::map<std::vector<size_t>, const File_t&> result;
+    IndexedFiles_t::const_iterator iindexedFiles(indexedFiles.find(name));
+    if (iindexedFiles != indexedFiles.end()) {
+        for (IndexedFiles_t::mapped_type::const_iterator ifiles(iindexedFiles->second.begin()) ;
+             ifiles != iindexedFiles->second.end() ;
+             ++ifiles) {
+
+            result.insert(std::pair<std::vector<size_t>, const File_t&>(
+                ifiles->first, *ifiles->second));
+        }
+    }
+    return result;
+}
+
+void CppHttpHandler_t::MimeParameters_t::index() const
+{
+    Parameters_t::index();
+    indexFiles();
+}
+
+void CppHttpHandler_t::MimeParameters_t::indexFiles() const
+{
+    if (!filesIndexed) {
+        indexedFiles.clear();
+        std::string pattern;
+        std::vector<size_t> indexes;
+        for (FileData_t::const_iterator ifileData(fileData.begin()) ;
+             ifileData != fileData.end() ;
+             ++ifileData) {
+
+            if (splitIndexes(ifileData->first.data(), ifileData->first.size(),
+                             pattern, indexes)) {
+                indexedFiles[pattern].push_back(
+                    std::make_pair(indexes, &ifileData->second.front()));
+            }
+        }
+        filesIndexed = true;
+    }
+}
+
+} // namespace ThreadServer
@@ -0,0 +1,485 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+
+namespace ThreadServer {
+
+namespace {
+
+int hexValue(const char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 0xa;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 0xa;
+    }
+    return -1;
+}
+
+// first '%' or '+' in [data, end), end if there is none
+const char* findEscape(const char *data, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i percent(_mm_set1_epi8('%'));
+    const __m128i plus(_mm_set1_epi8('+'));
+    for ( ; end - data >= 16 ; data += 16) {
+        __m128i block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+        int mask(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, percent),
+                                                _mm_cmpeq_epi8(block, plus))));
+        if (mask) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for ( ; data < end ; ++data) {
+        if (*data == '%' || *data == '+') {
+            return data;
+        }
+    }
+    return end;
+}
+
+// '+' is a space, invalid escapes are kept as they are
+void decode(const char *data, size_t size, std::string &result)
+{
+    result.reserve(result.size() + size);
+    const char *end(data + size);
+    while (data < end) {
+        const char *escape(findEscape(data, end));
+        result.append(data, escape);
+        if (escape == end) {
+            break;
+        }
+
+        data = escape;
+        int high;
+        int low;
+        if (*data == '+') {
+            result.push_back(' ');
+            ++data;
+        } else if (end - data > 2
+                   && (high = hexValue(data[1])) >= 0 && (low = hexValue(data[2])) >= 0) {
+            result.push_back(char(high * 16 + low));
+            data += 3;
+        } else {
+            // like %zz, kept literally
+            result.push_back(*data++);
+        }
+    }
+}
+
+inline bool isEscaped(const char *data, size_t size)
+{
+    return findEscape(data, data + size) != data + size;
+}
+
+inline int compare(const char *a, size_t aSize, const char *b, size_t bSize)
+{
+    int result(memcmp(a, b, std::min(aSize, bSize)));
+    return result ? result : (aSize < bSize ? -1 : aSize > bSize);
+}
+
+// orders entry indexes by name
+template<class Entries_t>
+class NameLess_t {
+public:
+    NameLess_t(const Entries_t &entries)
+      : entries(entries)
+    {
+    }
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return compare(entries[a].name, entries[a].nameSize,
+                       entries[b].name, entries[b].nameSize) < 0;
+    }
+
+    bool operator()(size_t a, const std::string &b) const
+    {
+        return compare(entries[a].name, entries[a].nameSize, b.data(), b.size()) < 0;
+    }
+
+    bool operator()(const std::string &a, size_t b) const
+    {
+        return compare(a.data(), a.size(), entries[b].name, entries[b].nameSize) < 0;
+    }
+
+    const Entries_t &entries;
+};
+
+template<class T_t>
+bool toSigned(const std::string &data, T_t &value)
+{
+    if (data.empty()) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    long long result(strtoll(data.c_str(), &end, 10));
+    if (*end || errno
+        || result < (long long)std::numeric_limits<T_t>::min()
+        || result > (long long)std::numeric_limits<T_t>::max()) {
+        return false;
+    }
+    value = T_t(result);
+    return true;
+}
+
+template<class T_t>
+bool toUnsigned(const std::string &data, T_t &value)
+{
+    if (data.empty() || data[0] == '-') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long result(strtoull(data.c_str(), &end, 10));
+    if (*end || errno || result > (unsigned long long)std::numeric_limits<T_t>::max()) {
+        return false;
+    }
+    value = T_t(result);
+    return true;
+}
+
+} // namespace
+
+CppHttpHandler_t::Parameters_t::Source_t::Source_t(const char *data, size_t size,
+                                                   const char *name, size_t nameSize)
+  : data(data),
+    size(size),
+    name(name),
+    nameSize(nameSize)
+{
+}
+
+CppHttpHandler_t::Parameters_t::Parameters_t()
+  : sources(),
+    owned(),
+    entries(),
+    order(),
+    prepared(0),
+    indexedEntries(),
+    indexedCount(0)
+{
+}
+
+void CppHttpHandler_t::Parameters_t::parse(const std::string &params)
+{
+    const std::string &copy(own(params));
+    parse(copy.data(), copy.size());
+}
+
+void CppHttpHandler_t::Parameters_t::parse(const char *data, size_t size)
+{
+    if (size) {
+        sources.push_back(Source_t(data, size));
+    }
+}
+
+void CppHttpHandler_t::Parameters_t::parseQuery(const std::string &unparsedUri)
+{
+    size_t begin(unparsedUri.find('?'));
+    if (begin == std::string::npos) {
+        return;
+    }
+    size_t end(unparsedUri.find('#', begin));
+    if (end == std::string::npos) {
+        end = unparsedUri.size();
+    }
+    parse(unparsedUri.data() + begin + 1, end - begin - 1);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, std::string &value) const
+{
+    const Entry_t *entry(first(name));
+    if (!entry) {
+        return false;
+    }
+    value = this->value(*entry);
+    return true;
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, int &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toSigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, long &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toSigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, long long &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toSigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, unsigned int &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toUnsigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, unsigned long &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toUnsigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name,
+                                              unsigned long long &value) const
+{
+    std::string data;
+    return getFirst(name, data) && toUnsigned(data, value);
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, double &value) const
+{
+    std::string data;
+    if (!getFirst(name, data) || data.empty()) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    double result(strtod(data.c_str(), &end));
+    if (*end || errno == ERANGE) {
+        return false;
+    }
+    value = result;
+    return true;
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirst(const std::string &name, bool &value) const
+{
+    std::string data;
+    if (!getFirst(name, data)) {
+        return false;
+    }
+    value = (data == "1" || data == "true" || data == "on");
+    return true;
+}
+
+bool CppHttpHandler_t::Parameters_t::has(const std::string &name) const
+{
+    return first(name);
+}
+
+size_t CppHttpHandler_t::Parameters_t::count(const std::string &name) const
+{
+    Range_t range(lookup(name));
+    return range.second - range.first;
+}
+
+bool CppHttpHandler_t::Parameters_t::getFirstBool(const std::string &name) const
+{
+    bool result(false);
+    getFirst(name, result);
+    return result;
+}
+
+std::list<bool> CppHttpHandler_t::Parameters_t::getBool(const std::string &name) const
+{
+    std::list<bool> result;
+    Range_t range(lookup(name));
+    for (const size_t *iorder(range.first) ; iorder != range.second ; ++iorder) {
+        std::string data(value(entries[*iorder]));
+        result.push_back(data == "1" || data == "true" || data == "on");
+    }
+    return result;
+}
+
+void CppHttpHandler_t::Parameters_t::add(const std::string &name, const std::string &value)
+{
+    const std::string &ownedName(own(name));
+    const std::string &ownedValue(own(value));
+    sources.push_back(Source_t(ownedValue.data(), ownedValue.size(),
+                               ownedName.data(), ownedName.size()));
+}
+
+void CppHttpHandler_t::Parameters_t::add(const std::string &name, const char *value,
+                                        size_t size)
+{
+    const std::string &ownedName(own(name));
+    sources.push_back(Source_t(value, size, ownedName.data(), ownedName.size()));
+}
+
+void CppHttpHandler_t::Parameters_t::prepare() const
+{
+    if (prepared == sources.size()) {
+        return;
+    }
+
+    for ( ; prepared < sources.size() ; ++prepared) {
+        const Source_t &source(sources[prepared]);
+        if (source.name) {
+            Entry_t entry;
+            entry.name = source.name;
+            entry.nameSize = source.nameSize;
+            entry.value = source.data;
+            entry.valueSize = source.size;
+            entry.escaped = false;
+            entries.push_back(entry);
+            continue;
+        }
+
+        const char *data(source.data);
+        const char *end(source.data + source.size);
+        entries.reserve(entries.size() + std::count(data, end, '&') + 1);
+        while (data < end) {
+            const char *next(static_cast<const char*>(memchr(data, '&', end - data)));
+            if (!next) {
+                next = end;
+            }
+            if (next != data) {
+                const char *equals(static_cast<const char*>(memchr(data, '=', next - data)));
+                Entry_t entry;
+                entry.name = data;
+                entry.nameSize = (equals ? equals : next) - data;
+                entry.value = equals ? equals + 1 : next;
+                entry.valueSize = next - entry.value;
+                entry.escaped = isEscaped(entry.value, entry.valueSize);
+                if (isEscaped(entry.name, entry.nameSize)) {
+                    std::string name;
+                    decode(entry.name, entry.nameSize, name);
+                    const std::string &ownedName(own(name));
+                    entry.name = ownedName.data();
+                    entry.nameSize = ownedName.size();
+                }
+                entries.push_back(entry);
+            }
+            data = next + 1;
+        }
+    }
+
+    order.resize(entries.size());
+    for (size_t i(0) ; i < order.size() ; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), NameLess_t<std::vector<Entry_t> >(entries));
+}
+
+CppHttpHandler_t::Parameters_t::Range_t
+CppHttpHandler_t::Parameters_t::lookup(const std::string &name) const
+{
+    prepare();
+    if (order.empty()) {
+        return Range_t(0, 0);
+    }
+    const size_t *begin(&order[0]);
+    return std::equal_range(begin, begin + order.size(), name, NameLess_t<std::vector<Entry_t> >(entries));
+}
+
+const CppHttpHandler_t::Parameters_t::Entry_t*
+CppHttpHandler_t::Parameters_t::first(const std::string &name) const
+{
+    Range_t range(lookup(name));
+    return range.first == range.second ? 0 : &entries[*range.first];
+}
+
+std::string CppHttpHandler_t::Parameters_t::value(const Entry_t &entry) const
+{
+    if (!entry.escaped) {
+        return std::string(entry.value, entry.valueSize);
+    }
+    std::string result;
+    decode(entry.value, entry.valueSize, result);
+    return result;
+}
+
+bool CppHttpHandler_t::Parameters_t::splitIndexes(const char *name, size_t size,
+                                                  std::string &pattern,
+                                                  std::vector<size_t> &indexes)
+{
+    pattern.clear();
+    indexes.clear();
+    const char *end(name + size);
+    while (name < end) {
+        const char *open(static_cast<const char*>(memchr(name, '[', end - name)));
+        if (!open) {
+            pattern.append(name, end);
+            break;
+        }
+        pattern.append(name, open + 1);
+        name = open + 1;
+
+        size_t index(0);
+        const char *digit(name);
+        while (digit < end && *digit >= '0' && *digit <= '9'
+               && index <= (std::numeric_limits<size_t>::max() - 9) / 10) {
+            index = index * 10 + (*digit++ - '0');
+        }
+        if (digit != name && digit < end && *digit == ']') {
+            indexes.push_back(index);
+            name = digit;
+        }
+    }
+    return !indexes.empty();
+}
+
+void CppHttpHandler_t::Parameters_t::index() const
+{
+    prepare();
+    indexNames();
+}
+
+void CppHttpHandler_t::Parameters_t::indexNames() const
+{
+    std::string entryPattern;
+    std::vector<size_t> indexes;
+    for ( ; indexedCount < entries.size() ; ++indexedCount) {
+        const Entry_t &entry(entries[indexedCount]);
+        if (splitIndexes(entry.name, entry.nameSize, entryPattern, indexes)) {
+            indexedEntries[entryPattern].push_back(std::make_pair(indexes, indexedCount));
+        }
+    }
+}
+
+const CppHttpHandler_t::Parameters_t::Indexed_t*
+CppHttpHandler_t::Parameters_t::indexed(const std::string &pattern) const
+{
+    index();
+
+    IndexedMap_t::const_iterator iindexed(indexedEntries.find(pattern));
+    return iindexed == indexedEntries.end() ? 0 : &iindexed->second;
+}
+
+const std::string& CppHttpHandler_t::Parameters_t::own(const std::string &data) const
+{
+    owned.push_back(data);
+    return owned.back();
+}
+
+int CppHttpHandler_t::Parameters_t::unhex(const char c)
+{
+    int value(hexValue(c));
+    if (value < 0) {
+        throw std::runtime_error("invalid hex digit");
+    }
+    return value;
+}
+
+std::string CppHttpHandler_t::Parameters_t::unescape(const std::string &s)
+{
+    std::string result;
+    decode(s.data(), s.size(), result);
+    return result;
+}
+
+} // namespace ThreadServer
@@ -0,0 +1,357 @@
+
+#include <ctype.h>
+#include <time.h>
+#include <algorithm>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+#include <threadserver/handlers/cpphttphandler/hash.h>
+
+namespace ThreadServer {
+
+namespace {
+
+class Cached_t {
+public:
+    Cached_t(const CppHttpHandler_t::Response_t &response)
+      : status(response.status),
+        headers(response.headers),
+        contentType(response.contentType),
+        body()
+    {
+        std::string *data(new std::string());
+        body.reset(data);
+        data->reserve(response.bodySize());
+        data->append(response.data);
+        for (CppHttpHandler_t::Response_t::Chain_t::const_iterator ichain(response.chain.begin()) ;
+             ichain != response.chain.end() ;
+             ++ichain) {
+
+            data->append(ichain->data, ichain->size);
+        }
+    }
+
+    int status;
+    CppHttpHandler_t::Headers_t headers;
+    std::string contentType;
+    boost::shared_ptr<const std::string> body;
+};
+
+typedef std::vector<std::string> Names_t;
+
+// responses that vary on request headers are stored under keys including
+// them, the key without them holds an entry with just the Vary
+class Entry_t {
+public:
+    Entry_t()
+      : cached(),
+        vary(),
+        expires(0),
+        staleUntil(0),
+        revalidating(false),
+        size(0),
+        lru()
+    {
+    }
+
+    boost::shared_ptr<const Cached_t> cached;
+    Names_t vary;
+    time_t expires;
+    time_t staleUntil;
+    bool revalidating;
+    size_t size;
+    std::list<const std::string*>::iterator lru;
+};
+
+// rough per entry bookkeeping overhead including headers
+const size_t ENTRY_OVERHEAD = 256;
+
+std::string baseKey(const CppHttpHandler_t::Request_t &request,
+                    const CppHttpHandler_t::CachePolicy_t &policy)
+{
+    std::string result(request.method);
+    result.push_back(' ');
+    result.append(request.unparsedUri);
+    for (Names_t::const_iterator iheaders(policy.headers.begin()) ;
+         iheaders != policy.headers.end() ;
+         ++iheaders) {
+
+        std::string value;
+        request.headers.get(*iheaders, value);
+        result.push_back('\n');
+        result.append(*iheaders);
+        result.push_back(':');
+        result.append(value);
+    }
+    return result;
+}
+
+std::string variantKey(const std::string &base, const CppHttpHandler_t::Request_t &request,
+                       const Names_t &vary)
+{
+    std::string result(base);
+    for (Names_t::const_iterator ivary(vary.begin()) ; ivary != vary.end() ; ++ivary) {
+        std::string value;
+        request.headers.get(*ivary, value);
+        result.append("\n~");
+        result.append(*ivary);
+        result.push_back(':');
+        result.append(value);
+    }
+    return result;
+}
+
+// names of all Vary headers, false for Vary: *
+bool parseVary(const CppHttpHandler_t::Response_t &response, Names_t &vary)
+{
+    std::string value;
+    for (int index(0) ; !response.headers.get("Vary", value, index) ; ++index) {
+        size_t begin(0);
+        while (begin < value.size()) {
+            size_t end(value.find(',', begin));
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+            size_t first(value.find_first_not_of(" \t", begin));
+            size_t last(value.find_last_not_of(" \t", end - 1));
+            if (first < end && last != std::string::npos && last >= first) {
+                std::string name(value, first, last - first + 1);
+                if (name == "*") {
+                    return false;
+                }
+                for (std::string::iterator iname(name.begin()) ; iname != name.end() ; ++iname) {
+                    *iname = tolower(static_cast<unsigned char>(*iname));
+                }
+                if (std::find(vary.begin(), vary.end(), name) == vary.end()) {
+                    vary.push_back(name);
+                }
+            }
+            begin = end + 1;
+        }
+    }
+    std::sort(vary.begin(), vary.end());
+    return true;
+}
+
+} // namespace
+
+class CppHttpHandler_t::ResponseCache_t::Shard_t {
+public:
+    typedef std::map<std::string, Entry_t> Entries_t;
+
+    Shard_t()
+      : mutex(),
+        entries(),
+        lru(),
+        maxSize(0),
+        stats()
+    {
+    }
+
+    void insert(const std::string &key, const Entry_t &inserted)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        Entries_t::iterator ientries(entries.find(key));
+        if (ientries != entries.end()) {
+            erase(ientries);
+        }
+
+        ientries = entries.insert(std::make_pair(key, inserted)).first;
+        lru.push_front(&ientries->first);
+        ientries->second.lru = lru.begin();
+        stats.size += inserted.size;
+        if (inserted.cached) {
+            ++stats.stores;
+        }
+
+        while (stats.size > maxSize && !lru.empty()) {
+            erase(entries.find(*lru.back()));
+            ++stats.evictions;
+        }
+    }
+
+    void erase(Entries_t::iterator ientries)
+    {
+        stats.size -= ientries->second.size;
+        lru.erase(ientries->second.lru);
+        entries.erase(ientries);
+    }
+
+    boost::mutex mutex;
+    Entries_t entries;
+    std::list<const std::string*> lru;
+    size_t maxSize;
+    Stats_t stats;
+};
+
+CppHttpHandler_t::CachePolicy_t::CachePolicy_t(const time_t ttl,
+                                               const time_t staleTtl,
+                                               const std::vector<std::string> &headers)
+  : ttl(ttl),
+    staleTtl(staleTtl),
+    headers(headers)
+{
+}
+
+CppHttpHandler_t::ResponseCache_t::Stats_t::Stats_t()
+  : hits(0),
+    staleHits(0),
+    misses(0),
+    stores(0),
+    evictions(0),
+    entries(0),
+    size(0)
+{
+}
+
+CppHttpHandler_t::ResponseCache_t::ResponseCache_t(const size_t maxSize,
+                                                   const size_t shardCount)
+  : shardCount(shardCount ? shardCount : 1),
+    shards(0)
+{
+    shards = new Shard_t[this->shardCount];
+    for (size_t i(0) ; i < this->shardCount ; ++i) {
+        shards[i].maxSize = maxSize / this->shardCount;
+    }
+}
+
+CppHttpHandler_t::ResponseCache_t::~ResponseCache_t()
+{
+    delete [] shards;
+}
+
+std::string CppHttpHandler_t::ResponseCache_t::key(const Request_t &request,
+                                                   const CachePolicy_t &policy)
+{
+    std::string base(baseKey(request, policy));
+    Names_t vary;
+    {
+        Shard_t &shard(this->shard(base));
+        boost::mutex::scoped_lock lock(shard.mutex);
+        Shard_t::Entries_t::const_iterator ientries(shard.entries.find(base));
+        if (ientries == shard.entries.end() || ientries->second.vary.empty()) {
+            return base;
+        }
+        vary = ientries->second.vary;
+    }
+    return variantKey(base, request, vary);
+}
+
+CppHttpHandler_t::ResponseCache_t::Result_t
+CppHttpHandler_t::ResponseCache_t::lookup(const std::string &key, Response_t &response)
+{
+    Shard_t &shard(this->shard(key));
+    boost::shared_ptr<const Cached_t> cached;
+    Result_t result(HIT);
+    {
+        boost::mutex::scoped_lock lock(shard.mutex);
+        Shard_t::Entries_t::iterator ientries(shard.entries.find(key));
+        if (ientries == shard.entries.end()) {
+            ++shard.stats.misses;
+            return MISS;
+        }
+
+        Entry_t &entry(ientries->second);
+        time_t now(time(0));
+        if (!entry.cached || now >= entry.staleUntil) {
+            ++shard.stats.misses;
+            return MISS;
+        }
+        if (now >= entry.expires) {
+            ++shard.stats.staleHits;
+            if (!entry.revalidating) {
+                entry.revalidating = true;
+                result = STALE;
+            }
+        } else {
+            ++shard.stats.hits;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+        cached = entry.cached;
+    }
+
+    response.status = cached->status;
+    response.headers = cached->headers;
+    response.contentType = cached->contentType;
+    response.data.clear();
+    response.chain.clear();
+    response.append(cached->body);
+    response.cacheable = true;
+    return result;
+}
+
+void CppHttpHandler_t::ResponseCache_t::store(const Request_t &request,
+                                              const std::string &requestKey,
+                                              const CachePolicy_t &policy,
+                                              const Response_t &response)
+{
+    Names_t vary;
+    if (response.status != 200 || response.streaming() || response.file.size
+        || !parseVary(response, vary)) {
+        abandon(requestKey);
+        return;
+    }
+
+    std::string base(baseKey(request, policy));
+    std::string key(vary.empty() ? base : variantKey(base, request, vary));
+    if (key != requestKey) {
+        abandon(requestKey);
+    }
+
+    boost::shared_ptr<const Cached_t> cached(new Cached_t(response));
+    size_t size(key.size() + cached->body->size() + ENTRY_OVERHEAD);
+    if (size > shard(key).maxSize) {
+        abandon(key);
+        return;
+    }
+
+    time_t now(time(0));
+    Entry_t entry;
+    entry.expires = now + policy.ttl;
+    entry.staleUntil = entry.expires + policy.staleTtl;
+    if (!vary.empty()) {
+        // tells key() which headers to add for this URI
+        entry.vary = vary;
+        entry.size = base.size() + ENTRY_OVERHEAD;
+        shard(base).insert(base, entry);
+        entry.vary.clear();
+    }
+    entry.cached = cached;
+    entry.size = size;
+    shard(key).insert(key, entry);
+}
+
+void CppHttpHandler_t::ResponseCache_t::abandon(const std::string &key)
+{
+    Shard_t &shard(this->shard(key));
+    boost::mutex::scoped_lock lock(shard.mutex);
+    Shard_t::Entries_t::iterator ientries(shard.entries.find(key));
+    if (ientries != shard.entries.end()) {
+        ientries->second.revalidating = false;
+    }
+}
+
+CppHttpHandler_t::ResponseCache_t::Stats_t CppHttpHandler_t::ResponseCache_t::stats() const
+{
+    Stats_t result;
+    for (size_t i(0) ; i < shardCount ; ++i) {
+        boost::mutex::scoped_lock lock(shards[i].mutex);
+        result.hits += shards[i].stats.hits;
+        result.staleHits += shards[i].stats.staleHits;
+        result.misses += shards[i].stats.misses;
+        result.stores += shards[i].stats.stores;
+        result.evictions += shards[i].stats.evictions;
+        result.entries += shards[i].entries.size();
+        result.size += shards[i].stats.size;
+    }
+    return result;
+}
+
+CppHttpHandler_t::ResponseCache_t::Shard_t&
+CppHttpHandler_t::ResponseCache_t::shard(const std::string &key)
+{
+    return shards[hash64(key.data(), key.size()) % shardCount];
+}
+
+} // namespace ThreadServer
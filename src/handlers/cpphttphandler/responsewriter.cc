@@ -0,0 +1,366 @@
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+
+namespace ThreadServer {
+
+namespace {
+
+struct Status_t {
+    int code;
+    const char *line;
+};
+
+const Status_t statuses[] = {
+    { 100, " 100 Continue\r\n" },
+    { 101, " 101 Switching Protocols\r\n" },
+    { 200, " 200 OK\r\n" },
+    { 201, " 201 Created\r\n" },
+    { 202, " 202 Accepted\r\n" },
+    { 203, " 203 Non-Authoritative Information\r\n" },
+    { 204, " 204 No Content\r\n" },
+    { 205, " 205 Reset Content\r\n" },
+    { 206, " 206 Partial Content\r\n" },
+    { 300, " 300 Multiple Choices\r\n" },
+    { 301, " 301 Moved Permanently\r\n" },
+    { 302, " 302 Found\r\n" },
+    { 303, " 303 See Other\r\n" },
+    { 304, " 304 Not Modified\r\n" },
+    { 305, " 305 Use Proxy\r\n" },
+    { 307, " 307 Temporary Redirect\r\n" },
+    { 400, " 400 Bad Request\r\n" },
+    { 401, " 401 Unauthorized\r\n" },
+    { 402, " 402 Payment Required\r\n" },
+    { 403, " 403 Forbidden\r\n" },
+    { 404, " 404 Not Found\r\n" },
+    { 405, " 405 Method Not Allowed\r\n" },
+    { 406, " 406 Not Acceptable\r\n" },
+    { 407, " 407 Proxy Authentication Required\r\n" },
+    { 408, " 408 Request Timeout\r\n" },
+    { 409, " 409 Conflict\r\n" },
+    { 410, " 410 Gone\r\n" },
+    { 411, " 411 Length Required\r\n" },
+    { 412, " 412 Precondition Failed\r\n" },
+    { 413, " 413 Request Entity Too Large\r\n" },
+    { 414, " 414 Request-URI Too Long\r\n" },
+    { 415, " 415 Unsupported Media Type\r\n" },
+    { 416, " 416 Request Range Not Satisfiable\r\n" },
+    { 417, " 417 Expectation Failed\r\n" },
+    { 500, " 500 Internal Server Error\r\n" },
+    { 501, " 501 Not Implemented\r\n" },
+    { 502, " 502 Bad Gateway\r\n" },
+    { 503, " 503 Service Unavailable\r\n" },
+    { 504, " 504 Gateway Timeout\r\n" },
+    { 505, " 505 HTTP Version Not Supported\r\n" }
+};
+
+class StatusTable_t {
+public:
+    enum { SIZE = 600 };
+
+    StatusTable_t()
+    {
+        memset(lines, 0, sizeof(lines));
+        memset(sizes, 0, sizeof(sizes));
+        for (size_t i(0) ; i < sizeof(statuses) / sizeof(statuses[0]) ; ++i) {
+            lines[statuses[i].code] = statuses[i].line;
+            sizes[statuses[i].code] = strlen(statuses[i].line);
+        }
+    }
+
+    const char *lines[SIZE];
+    size_t sizes[SIZE];
+};
+
+const StatusTable_t statusTable;
+
+inline void appendNumber(std::string &target, unsigned long long value)
+{
+    char digits[24];
+    char *end(digits + sizeof(digits));
+    char *begin(end);
+    do {
+        *--begin = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+    target.append(begin, end);
+}
+
+inline struct iovec makeIovec(const char *data, size_t size)
+{
+    struct iovec result;
+    result.iov_base = const_cast<char*>(data);
+    result.iov_len = size;
+    return result;
+}
+
+inline void appendHex(std::string &target, size_t value)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char digits[24];
+    char *end(digits + sizeof(digits));
+    char *begin(end);
+    do {
+        *--begin = hexDigits[value & 0xf];
+        value >>= 4;
+    } while (value);
+    target.append(begin, end);
+}
+
+} // namespace
+
+CppHttpHandler_t::ResponseWriter_t::ResponseWriter_t(size_t chunkSize)
+  : fd(-1),
+    writeTimeout(0),
+    chunkSize(chunkSize),
+    sentHead(false),
+    chunked(false),
+    headOnly(false),
+    buffer(),
+    pending(),
+    iov()
+{
+    buffer.reserve(4096);
+    pending.reserve(chunkSize);
+}
+
+void CppHttpHandler_t::ResponseWriter_t::reset(int fd, int writeTimeout, bool headOnly)
+{
+    this->fd = fd;
+    this->writeTimeout = writeTimeout;
+    this->headOnly = headOnly;
+    sentHead = false;
+    chunked = false;
+    pending.clear();
+}
+
+void CppHttpHandler_t::ResponseWriter_t::write(const Response_t &response)
+{
+    formatHead(response, false);
+    sentHead = true;
+
+    iov.clear();
+    iov.push_back(makeIovec(buffer.data(), buffer.size()));
+    if (headOnly) {
+        send();
+        return;
+    }
+    if (!response.data.empty()) {
+        iov.push_back(makeIovec(response.data.data(), response.data.size()));
+    }
+    for (Response_t::Chain_t::const_iterator ichain(response.chain.begin()) ;
+         ichain != response.chain.end() ;
+         ++ichain) {
+
+        if (ichain->size) {
+            iov.push_back(makeIovec(ichain->data, ichain->size));
+        }
+    }
+
+    if (response.file.size) {
+        send(MSG_MORE);
+        sendFile(response.file);
+    } else {
+        send();
+    }
+}
+
+void CppHttpHandler_t::ResponseWriter_t::writeHead(const Response_t &response)
+{
+    formatHead(response, true);
+    sentHead = true;
+
+    iov.clear();
+    iov.push_back(makeIovec(buffer.data(), buffer.size()));
+    send();
+}
+
+void CppHttpHandler_t::ResponseWriter_t::writeChunk(const char *data, size_t size)
+{
+    if (headOnly) {
+        return;
+    }
+    if (pending.size() + size < chunkSize) {
+        pending.append(data, size);
+        return;
+    }
+
+    sendChunk(data, size);
+}
+
+void CppHttpHandler_t::ResponseWriter_t::flush()
+{
+    if (!pending.empty()) {
+        sendChunk(0, 0);
+    }
+}
+
+// an empty chunk would be the terminating 0\r\n\r\n, so nothing is sent
+void CppHttpHandler_t::ResponseWriter_t::sendChunk(const char *data, size_t size)
+{
+    if (pending.empty() && !size) {
+        return;
+    }
+
+    iov.clear();
+    if (chunked) {
+        buffer.clear();
+        appendHex(buffer, pending.size() + size);
+        buffer.append("\r\n");
+        iov.push_back(makeIovec(buffer.data(), buffer.size()));
+    }
+    if (!pending.empty()) {
+        iov.push_back(makeIovec(pending.data(), pending.size()));
+    }
+    if (size) {
+        iov.push_back(makeIovec(data, size));
+    }
+    if (chunked) {
+        iov.push_back(makeIovec("\r\n", 2));
+    }
+    send();
+    pending.clear();
+}
+
+void CppHttpHandler_t::ResponseWriter_t::finish()
+{
+    flush();
+    if (chunked && !headOnly) {
+        iov.clear();
+        iov.push_back(makeIovec("0\r\n\r\n", 5));
+        send();
+    }
+}
+
+bool CppHttpHandler_t::ResponseWriter_t::headSent() const
+{
+    return sentHead;
+}
+
+void CppHttpHandler_t::ResponseWriter_t::formatHead(const Response_t &response, bool streaming)
+{
+    buffer.clear();
+    buffer.append(response.protocol);
+    if (response.status > 0 && response.status < StatusTable_t::SIZE
+        && statusTable.lines[response.status]) {
+
+        buffer.append(statusTable.lines[response.status],
+                      statusTable.sizes[response.status]);
+    } else {
+        buffer.push_back(' ');
+        appendNumber(buffer, response.status);
+        buffer.push_back(' ');
+        if (!response.statusMessage.empty()) {
+            buffer.append(response.statusMessage);
+        } else {
+            buffer.append("Unknown");
+        }
+        buffer.append("\r\n");
+    }
+
+    for (size_t i(0) ; i < response.headers.size() ; ++i) {
+        Headers_t::View_t name(response.headers.name(i));
+        Headers_t::View_t value(response.headers.value(i));
+        buffer.append(name.data, name.size);
+        buffer.append(": ", 2);
+        buffer.append(value.data, value.size);
+        buffer.append("\r\n", 2);
+    }
+
+    // 1xx, 204 and 304 responses have no body, HEAD sends the length the
+    // body would have
+    bool contentLength(!response.headers[Headers_t::CONTENT_LENGTH].empty());
+    if (streaming) {
+        chunked = (!contentLength && !headOnly && response.protocol == "HTTP/1.1");
+        if (chunked) {
+            buffer.append("Transfer-Encoding: chunked\r\n");
+        }
+    } else if (!contentLength && response.status / 100 != 1
+               && response.status != 204 && response.status != 304) {
+        buffer.append("Content-Length: ");
+        appendNumber(buffer, response.bodySize());
+        buffer.append("\r\n");
+    }
+    buffer.append("\r\n");
+}
+
+void CppHttpHandler_t::ResponseWriter_t::send(int flags)
+{
+    size_t first(0);
+    while (first < iov.size()) {
+        waitWritable();
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov[first];
+        message.msg_iovlen = std::min(iov.size() - first, size_t(IOV_MAX));
+
+        ssize_t sent(sendmsg(fd, &message, MSG_NOSIGNAL | flags));
+        if (sent < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            throw Error_t("Can't send data: %s", strerror(errno));
+        }
+
+        while (first < iov.size() && size_t(sent) >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            ++first;
+        }
+        if (sent) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+}
+
+void CppHttpHandler_t::ResponseWriter_t::sendFile(const Response_t::FileRange_t &file)
+{
+    off_t offset(file.offset);
+    size_t left(file.size);
+    while (left) {
+        waitWritable();
+
+        ssize_t sent(::sendfile(fd, file.fd, &offset, std::min(left, size_t(0x40000000))));
+        if (sent < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            throw Error_t("Can't send file: %s", strerror(errno));
+        }
+        if (!sent) {
+            throw Error_t("Can't send file: file truncated");
+        }
+        left -= sent;
+    }
+}
+
+void CppHttpHandler_t::ResponseWriter_t::waitWritable()
+{
+    for (;;) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        int ready(poll(&pfd, 1, writeTimeout));
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Error_t("Can't send data: %s", strerror(errno));
+        }
+        if (!ready) {
+            throw Error_t("Can't send data: write timeout");
+        }
+        return;
+    }
+}
+
+} // namespace ThreadServer
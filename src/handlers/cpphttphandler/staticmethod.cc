@@ -0,0 +1,331 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <threadserver/error.h>
+#include <threadserver/handlers/cpphttphandler/cpphttphandler.h>
+#include <threadserver/handlers/cpphttphandler/hash.h>
+
+namespace ThreadServer {
+
+namespace {
+
+struct ContentType_t {
+    const char *extension;
+    const char *contentType;
+};
+
+const ContentType_t contentTypes[] = {
+    { "css", "text/css" },
+    { "csv", "text/csv" },
+    { "gif", "image/gif" },
+    { "gz", "application/x-gzip" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "ico", "image/x-icon" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "pdf", "application/pdf" },
+    { "png", "image/png" },
+    { "svg", "image/svg+xml" },
+    { "txt", "text/plain" },
+    { "woff", "application/font-woff" },
+    { "xml", "text/xml" },
+    { "zip", "application/zip" }
+};
+
+const char* contentTypeOf(const std::string &path)
+{
+    size_t dot(path.rfind('.'));
+    size_t slash(path.rfind('/'));
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        const char *extension(path.c_str() + dot + 1);
+        for (size_t i(0) ; i < sizeof(contentTypes) / sizeof(contentTypes[0]) ; ++i) {
+            if (!strcasecmp(extension, contentTypes[i].extension)) {
+                return contentTypes[i].contentType;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+int unhex(const char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 0xa;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 0xa;
+    }
+    return -1;
+}
+
+// decodes %XX escapes and rejects anything that could leave the root
+bool normalizePath(const std::string &uri, std::string &path)
+{
+    std::string decoded;
+    decoded.reserve(uri.size());
+    for (size_t i(0) ; i < uri.size() ; ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()
+            && unhex(uri[i+1]) >= 0 && unhex(uri[i+2]) >= 0) {
+
+            decoded.push_back(char(unhex(uri[i+1]) * 16 + unhex(uri[i+2])));
+            i += 2;
+        } else {
+            decoded.push_back(uri[i]);
+        }
+    }
+
+    path.clear();
+    size_t begin(0);
+    while (begin <= decoded.size()) {
+        size_t end(decoded.find('/', begin));
+        if (end == std::string::npos) {
+            end = decoded.size();
+        }
+        std::string segment(decoded, begin, end - begin);
+        if (segment == "..") {
+            return false;
+        }
+        if (segment.find('\0') != std::string::npos) {
+            return false;
+        }
+        if (!segment.empty() && segment != ".") {
+            path += "/" + segment;
+        }
+        begin = end + 1;
+    }
+    return !path.empty();
+}
+
+// parses a single "bytes=first-last" range, multiple ranges are served whole
+bool parseRange(const std::string &range, size_t size, size_t &first, size_t &last,
+                bool &satisfiable)
+{
+    satisfiable = true;
+    if (range.compare(0, 6, "bytes=") || range.find(',') != std::string::npos) {
+        return false;
+    }
+
+    std::string spec(range.substr(6));
+    size_t dash(spec.find('-'));
+    if (dash == std::string::npos) {
+        return false;
+    }
+
+    char *end;
+    if (!dash) {
+        unsigned long long suffix(strtoull(spec.c_str() + 1, &end, 10));
+        if (*end || dash + 1 == spec.size()) {
+            return false;
+        }
+        if (!suffix || !size) {
+            satisfiable = false;
+            return true;
+        }
+        first = (suffix < size) ? size - suffix : 0;
+        last = size - 1;
+        return true;
+    }
+
+    first = strtoull(spec.c_str(), &end, 10);
+    if (end != spec.c_str() + dash) {
+        return false;
+    }
+    if (dash + 1 == spec.size()) {
+        last = size - 1;
+    } else {
+        last = strtoull(spec.c_str() + dash + 1, &end, 10);
+        if (*end || last < first) {
+            return false;
+        }
+        if (last >= size) {
+            last = size - 1;
+        }
+    }
+    if (first >= size) {
+        satisfiable = false;
+    }
+    return true;
+}
+
+// changes whenever the file is replaced or modified
+std::string fileETag(const struct stat &info)
+{
+    uint64_t values[] = { uint64_t(info.st_dev), uint64_t(info.st_ino),
+                          uint64_t(info.st_size), uint64_t(info.st_mtime) };
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "\"%016llx\"",
+             (unsigned long long)hash64(reinterpret_cast<const char*>(values), sizeof(values)));
+    return buffer;
+}
+
+} // namespace
+
+class CppHttpHandler_t::StaticMethod_t::File_t {
+public:
+    File_t(int fd, const struct stat &info, time_t checked)
+      : fd(fd),
+        info(info),
+        checked(checked)
+    {
+    }
+
+    ~File_t()
+    {
+        ::close(fd);
+    }
+
+    int fd;
+    struct stat info;
+    time_t checked;
+};
+
+CppHttpHandler_t::StaticMethod_t::StaticMethod_t(const std::string &documentRoot,
+                                                 const size_t cacheSize,
+                                                 const time_t revalidateTimeout)
+  : Method_t(),
+    documentRoot(documentRoot),
+    cacheSize(cacheSize),
+    revalidateTimeout(revalidateTimeout),
+    mutex(),
+    cache(),
+    lru()
+{
+}
+
+CppHttpHandler_t::StaticMethod_t::~StaticMethod_t()
+{
+}
+
+void CppHttpHandler_t::StaticMethod_t::call(const Request_t &request, Response_t &response)
+{
+    if (request.method != "GET" && request.method != "HEAD") {
+        response.headers.set("Allow", "GET, HEAD");
+        throw HttpError_t(405, "Method %s not allowed", request.method.c_str());
+    }
+
+    std::string path;
+    if (!normalizePath(request.matchGroups.empty()
+                       ? request.uri : request.matchGroups.front(), path)) {
+        throw HttpError_t(404, "File %s not found", request.uri.c_str());
+    }
+
+    boost::shared_ptr<File_t> file(open(documentRoot + path));
+    if (!file) {
+        throw HttpError_t(404, "File %s not found", request.uri.c_str());
+    }
+
+    size_t size(file->info.st_size);
+    size_t first(0);
+    size_t last(size ? size - 1 : 0);
+
+    response.contentType = contentTypeOf(path);
+    response.lastModified = file->info.st_mtime;
+    response.etag = fileETag(file->info);
+    response.headers.set("Accept-Ranges", "bytes");
+
+    std::string range(request.headers[Headers_t::RANGE].str());
+    bool satisfiable;
+    if (!range.empty() && parseRange(range, size, first, last, satisfiable)) {
+        if (!satisfiable) {
+            response.headers.set("Content-Range",
+                "bytes */" + boost::lexical_cast<std::string>(size));
+            throw HttpError_t(416, "Range %s not satisfiable", range.c_str());
+        }
+        response.status = 206;
+        response.headers.set("Content-Range",
+            "bytes " + boost::lexical_cast<std::string>(first)
+            + "-" + boost::lexical_cast<std::string>(last)
+            + "/" + boost::lexical_cast<std::string>(size));
+    }
+
+    size_t length(size ? last - first + 1 : 0);
+    if (request.method == "HEAD") {
+        response.headers.set("Content-Length", boost::lexical_cast<std::string>(length));
+        return;
+    }
+
+    response.sendFile(file->fd, first, length, file);
+}
+
+boost::shared_ptr<CppHttpHandler_t::StaticMethod_t::File_t>
+CppHttpHandler_t::StaticMethod_t::open(const std::string &path)
+{
+    time_t now(time(0));
+    boost::shared_ptr<File_t> cached;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        Cache_t::iterator icache(cache.find(path));
+        if (icache != cache.end()) {
+            lru.splice(lru.begin(), lru, icache->second.second);
+            cached = icache->second.first;
+            if (now - cached->checked < revalidateTimeout) {
+                return cached;
+            }
+        }
+    }
+
+    struct stat info;
+    if (stat(path.c_str(), &info) < 0 || !S_ISREG(info.st_mode)) {
+        boost::mutex::scoped_lock lock(mutex);
+        Cache_t::iterator icache(cache.find(path));
+        if (icache != cache.end()) {
+            lru.erase(icache->second.second);
+            cache.erase(icache);
+        }
+        return boost::shared_ptr<File_t>();
+    }
+
+    if (cached
+        && cached->info.st_dev == info.st_dev
+        && cached->info.st_ino == info.st_ino
+        && cached->info.st_size == info.st_size
+        && cached->info.st_mtime == info.st_mtime) {
+
+        boost::mutex::scoped_lock lock(mutex);
+        cached->checked = now;
+        return cached;
+    }
+
+    int fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+        return boost::shared_ptr<File_t>();
+    }
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        ::close(fd);
+        return boost::shared_ptr<File_t>();
+    }
+    boost::shared_ptr<File_t> file(new File_t(fd, info, now));
+
+    boost::mutex::scoped_lock lock(mutex);
+    Cache_t::iterator icache(cache.find(path));
+    if (icache != cache.end()) {
+        icache->second.first = file;
+        lru.splice(lru.begin(), lru, icache->second.second);
+    } else {
+        lru.push_front(path);
+        cache.insert(std::make_pair(path, std::make_pair(file, lru.begin())));
+    }
+    while (cache.size() > cacheSize && !lru.empty()) {
+        cache.erase(lru.back());
+        lru.pop_back();
+    }
+    return file;
+}
+
+} // namespace ThreadServer
@@ -0,0 +1,47 @@
+
+#include <algorithm>
+#include <threadserver/batch.h>
+
+namespace ThreadServer {
+
+ParallelBatch_t::ParallelBatch_t(const size_t count)
+  : count(count),
+    next(0),
+    done(0),
+    mutex(),
+    finished()
+{
+}
+
+ParallelBatch_t::~ParallelBatch_t()
+{
+}
+
+void ParallelBatch_t::run()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    while (next < count) {
+        size_t index(next++);
+        lock.unlock();
+        runPart(index);
+        lock.lock();
+        if (++done == count) {
+            finished.notify_all();
+        }
+    }
+}
+
+void ParallelBatch_t::wait()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    while (done < count) {
+        finished.wait(lock);
+    }
+}
+
+size_t ParallelBatch_t::helpers(const size_t threads) const
+{
+    return std::min(count ? count - 1 : 0, threads);
+}
+
+} // namespace ThreadServer